@@ -0,0 +1,97 @@
+#pragma once
+#include "esp_camera.h"
+#include "camera_control.h"
+
+// Capture to last byte written latency the controller tries to hold (ms)
+#define ABR_TARGET_LATENCY_MS 150
+// Frames measured between two adjustments
+#define ABR_INTERVAL 10
+// JPEG quality range used by the controller, lower numbers are better
+#define ABR_BEST_QUALITY 10
+#define ABR_WORST_QUALITY 40
+#define ABR_QUALITY_STEP 4
+
+// Frame sizes the controller steps through once quality is exhausted
+static const framesize_t bitrateLadder[] = {
+  FRAMESIZE_QQVGA, FRAMESIZE_QVGA, FRAMESIZE_CIF, FRAMESIZE_VGA,
+  FRAMESIZE_SVGA, FRAMESIZE_XGA, FRAMESIZE_HD, FRAMESIZE_SXGA, FRAMESIZE_UXGA
+};
+#define BITRATE_LADDER_LENGTH (sizeof(bitrateLadder) / sizeof(bitrateLadder[0]))
+
+// Closed loop controller that trades JPEG quality, and then frame size,
+// for latency. Fed with the timing of every frame a client has written.
+struct BitrateController {
+  float latency;    // smoothed capture to sent latency, ms
+  float queueDelay; // smoothed capture to first send latency, ms
+  float throughput; // smoothed send rate, kB/s
+  uint32_t samples;
+  // Frame size steps taken down by the controller, only those are undone
+  int framesizeSteps;
+};
+
+static int ladderIndex(framesize_t framesize) {
+  int index = 0;
+  for (int i = 0; i < (int)BITRATE_LADDER_LENGTH; i++) {
+    if (bitrateLadder[i] <= framesize) {
+      index = i;
+    }
+  }
+  return index;
+}
+
+static void bitrateAdjust(BitrateController &abr) {
+  sensor_t *s = esp_camera_sensor_get();
+  int quality = s->status.quality;
+  framesize_t framesize = s->status.framesize;
+  CameraSettings changes = { -1, -1, -1 };
+
+  if (abr.latency > ABR_TARGET_LATENCY_MS) {
+    if (quality < ABR_WORST_QUALITY) {
+      changes.quality = min(quality + ABR_QUALITY_STEP, ABR_WORST_QUALITY);
+    } else if (ladderIndex(framesize) > 0) {
+      changes.framesize = bitrateLadder[ladderIndex(framesize) - 1];
+      changes.quality = ABR_BEST_QUALITY + (ABR_WORST_QUALITY - ABR_BEST_QUALITY) / 2;
+      abr.framesizeSteps++;
+    }
+  } else if (abr.latency < ABR_TARGET_LATENCY_MS / 2) {
+    if (abr.framesizeSteps > 0 && quality <= ABR_BEST_QUALITY) {
+      int index = ladderIndex(framesize) + 1;
+      if (index < (int)BITRATE_LADDER_LENGTH && bitrateLadder[index] <= cameraMaxFramesize) {
+        changes.framesize = bitrateLadder[index];
+        changes.quality = ABR_WORST_QUALITY;
+      }
+      abr.framesizeSteps--;
+    } else if (quality > ABR_BEST_QUALITY) {
+      changes.quality = max(quality - ABR_QUALITY_STEP, ABR_BEST_QUALITY);
+    }
+  }
+
+  if (changes.quality >= 0 || changes.framesize >= 0) {
+    Serial.printf("Bitrate: latency %.0f ms (queue %.0f ms), %.0f kB/s\n",
+                  abr.latency, abr.queueDelay, abr.throughput);
+    requestSettings(0, changes);
+  }
+}
+
+// Records a frame that has been written completely. `captured`, `published`
+// and `finished` are esp_timer_get_time() timestamps.
+void bitrateFrameSent(BitrateController &abr, size_t bytes, int64_t captured, int64_t published, int64_t finished) {
+  float latency = (finished - captured) / 1000.0;
+  float queueDelay = (published - captured) / 1000.0;
+  float sendTime = max(finished - published, (int64_t)1) / 1000.0;
+  float throughput = bytes / sendTime; // bytes per ms equals kB/s
+
+  if (abr.samples == 0) {
+    abr.latency = latency;
+    abr.queueDelay = queueDelay;
+    abr.throughput = throughput;
+  } else {
+    abr.latency += (latency - abr.latency) * 0.2;
+    abr.queueDelay += (queueDelay - abr.queueDelay) * 0.2;
+    abr.throughput += (throughput - abr.throughput) * 0.2;
+  }
+
+  if (++abr.samples % ABR_INTERVAL == 0) {
+    bitrateAdjust(abr);
+  }
+}
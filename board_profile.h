@@ -0,0 +1,114 @@
+#pragma once
+#include "esp_camera.h"
+#include "camera_pins.h"
+
+// Everything about the selected board that is known when compiling. The
+// profile is constexpr, so settings that don't apply to the board compile
+// away and impossible configurations fail to build.
+struct BoardPins {
+  int8_t pwdn;
+  int8_t reset;
+  int8_t xclk;
+  int8_t sda;
+  int8_t scl;
+  int8_t data[8]; // D0 (Y2) to D7 (Y9)
+  int8_t vsync;
+  int8_t href;
+  int8_t pclk;
+};
+
+struct BoardProfile {
+  BoardPins pins;
+  bool psram;
+  uint8_t fbCount;
+  framesize_t framesize;       // frame buffers are allocated for this size
+  framesize_t streamFramesize; // size streaming starts with
+  int jpegQuality;
+  camera_grab_mode_t grabMode;
+  bool vflip;
+  bool hmirror;
+  bool dataPullups; // D1 and D2 need the internal pull-ups (ESP-EYE)
+};
+
+// Boards that come without PSRAM
+#if defined(CAMERA_MODEL_M5STACK_ESP32CAM) || defined(CAMERA_MODEL_M5STACK_UNITCAM) || \
+    defined(CAMERA_MODEL_TTGO_T_JOURNAL)
+#define BOARD_PSRAM false
+#else
+#define BOARD_PSRAM true
+#endif
+
+#if defined(CAMERA_MODEL_M5STACK_WIDE) || defined(CAMERA_MODEL_M5STACK_ESP32CAM)
+#define BOARD_VFLIP true
+#define BOARD_HMIRROR true
+#elif defined(CAMERA_MODEL_ESP32S3_EYE)
+#define BOARD_VFLIP true
+#define BOARD_HMIRROR false
+#else
+#define BOARD_VFLIP false
+#define BOARD_HMIRROR false
+#endif
+
+#if defined(CAMERA_MODEL_ESP_EYE)
+#define BOARD_DATA_PULLUPS true
+#else
+#define BOARD_DATA_PULLUPS false
+#endif
+
+// With PSRAM, two UXGA frame buffers so one is filled while the other is
+// sent, more if the pipeline holds more (see FRAME_BUFFERS). Without, a
+// single SVGA buffer is all that fits in DRAM.
+constexpr BoardProfile withPsram(const BoardPins &pins) {
+  return { pins, true, 2, FRAMESIZE_UXGA, FRAMESIZE_QVGA, 10, CAMERA_GRAB_LATEST,
+           BOARD_VFLIP, BOARD_HMIRROR, BOARD_DATA_PULLUPS };
+}
+
+constexpr BoardProfile withoutPsram(const BoardPins &pins) {
+  return { pins, false, 1, FRAMESIZE_SVGA, FRAMESIZE_QVGA, 12, CAMERA_GRAB_WHEN_EMPTY,
+           BOARD_VFLIP, BOARD_HMIRROR, BOARD_DATA_PULLUPS };
+}
+
+constexpr BoardPins boardPins = {
+  PWDN_GPIO_NUM, RESET_GPIO_NUM, XCLK_GPIO_NUM, SIOD_GPIO_NUM, SIOC_GPIO_NUM,
+  { Y2_GPIO_NUM, Y3_GPIO_NUM, Y4_GPIO_NUM, Y5_GPIO_NUM, Y6_GPIO_NUM, Y7_GPIO_NUM, Y8_GPIO_NUM, Y9_GPIO_NUM },
+  VSYNC_GPIO_NUM, HREF_GPIO_NUM, PCLK_GPIO_NUM,
+};
+
+constexpr BoardProfile board = BOARD_PSRAM ? withPsram(boardPins) : withoutPsram(boardPins);
+// Used when a board that should have PSRAM turns out not to
+constexpr BoardProfile boardWithoutPsram = withoutPsram(boardPins);
+
+// Pins the camera can't work without, -1 (not connected) isn't allowed
+constexpr int8_t requiredPins[] = {
+  boardPins.xclk, boardPins.sda, boardPins.scl, boardPins.vsync, boardPins.href, boardPins.pclk,
+  boardPins.data[0], boardPins.data[1], boardPins.data[2], boardPins.data[3],
+  boardPins.data[4], boardPins.data[5], boardPins.data[6], boardPins.data[7],
+};
+constexpr int8_t allPins[] = {
+  boardPins.pwdn, boardPins.reset, boardPins.xclk, boardPins.sda, boardPins.scl,
+  boardPins.vsync, boardPins.href, boardPins.pclk,
+  boardPins.data[0], boardPins.data[1], boardPins.data[2], boardPins.data[3],
+  boardPins.data[4], boardPins.data[5], boardPins.data[6], boardPins.data[7],
+};
+#define PIN_COUNT(pins) (int)(sizeof(pins) / sizeof(pins[0]))
+
+// Recursive, so this still works as C++11
+constexpr bool pinsConnected(const int8_t *pins, int count) {
+  return count == 0 || (pins[0] >= 0 && pinsConnected(pins + 1, count - 1));
+}
+
+constexpr bool pinUsed(const int8_t *pins, int count, int8_t pin) {
+  return count > 0 && (pins[0] == pin || pinUsed(pins + 1, count - 1, pin));
+}
+
+constexpr bool pinsDistinct(const int8_t *pins, int count) {
+  return count == 0 || ((pins[0] < 0 || !pinUsed(pins + 1, count - 1, pins[0])) && pinsDistinct(pins + 1, count - 1));
+}
+
+static_assert(pinsConnected(requiredPins, PIN_COUNT(requiredPins)), "Camera pin not connected in camera_pins.h");
+static_assert(pinsDistinct(allPins, PIN_COUNT(allPins)), "Camera pin assigned twice in camera_pins.h");
+static_assert(board.fbCount >= 1 && (board.psram || board.fbCount == 1),
+              "More than one frame buffer needs PSRAM");
+static_assert(board.streamFramesize <= board.framesize, "Streaming can't start larger than the frame buffers");
+static_assert(board.fbCount > 1 || board.grabMode == CAMERA_GRAB_WHEN_EMPTY,
+              "CAMERA_GRAB_LATEST needs at least two frame buffers");
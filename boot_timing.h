@@ -0,0 +1,88 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "buffer_calibration.h"
+
+// Initializes the camera on its own task while setup() associates with
+// the access point, and records when the stream became ready. Times are
+// esp_timer_get_time() values, which count from boot.
+//
+// The camera task waits until the Wi-Fi driver is up: frame buffers are
+// sized to what is free, and the driver's buffers are the largest use of
+// internal RAM besides them.
+struct BootTiming {
+  int64_t cameraReady;
+  int64_t wifiReady;
+  int64_t streamReady; // servers listening
+  int64_t firstCapture;
+  int64_t firstSend;   // last byte of the first frame written to a client
+  bool cameraOk;
+  bool cameraTask; // initialized by cameraInitTask
+  SemaphoreHandle_t wifiStarted;
+  SemaphoreHandle_t cameraDone;
+};
+
+static BootTiming bootTiming;
+
+static void cameraInitTask(void *) {
+  xSemaphoreTake(bootTiming.wifiStarted, portMAX_DELAY);
+  bootTiming.cameraOk = initCamera();
+  bootTiming.cameraReady = esp_timer_get_time();
+  xSemaphoreGive(bootTiming.cameraDone);
+  vTaskDelete(NULL);
+}
+
+// Starts the camera init task, which waits for bootWifiStarted(). Falls
+// back to initializing the camera in bootWaitCamera() if the task can't be
+// created.
+void bootStartCamera() {
+  bootTiming.wifiStarted = xSemaphoreCreateBinary();
+  bootTiming.cameraDone = xSemaphoreCreateBinary();
+  bootTiming.cameraTask = bootTiming.wifiStarted && bootTiming.cameraDone &&
+                          xTaskCreate(cameraInitTask, "camera init", 8192, NULL, 5, NULL) == pdPASS;
+}
+
+// Passed to wifiConnect(), lets the camera task go on while associating.
+void bootWifiStarted() {
+  if (bootTiming.cameraTask) {
+    xSemaphoreGive(bootTiming.wifiStarted);
+  }
+}
+
+// Blocks until the camera is initialized, returns false if that failed.
+bool bootWaitCamera() {
+  if (!bootTiming.cameraTask) {
+    bootTiming.cameraOk = initCamera();
+    bootTiming.cameraReady = esp_timer_get_time();
+    return bootTiming.cameraOk;
+  }
+  xSemaphoreTake(bootTiming.cameraDone, portMAX_DELAY);
+  return bootTiming.cameraOk;
+}
+
+void bootWifiReady() {
+  bootTiming.wifiReady = esp_timer_get_time();
+}
+
+void bootStreamReady() {
+  bootTiming.streamReady = esp_timer_get_time();
+  Serial.printf("Boot: camera ready after %d ms, WiFi after %d ms, streaming after %d ms\n",
+                (int)(bootTiming.cameraReady / 1000), (int)(bootTiming.wifiReady / 1000),
+                (int)(bootTiming.streamReady / 1000));
+}
+
+void bootFrameCaptured() {
+  if (bootTiming.firstCapture == 0 && bootTiming.streamReady != 0) {
+    bootTiming.firstCapture = esp_timer_get_time();
+  }
+}
+
+void bootFrameSent() {
+  if (bootTiming.firstSend == 0 && bootTiming.streamReady != 0) {
+    bootTiming.firstSend = esp_timer_get_time();
+    Serial.printf("Boot: first frame captured after %d ms, sent after %d ms\n",
+                  (int)(bootTiming.firstCapture / 1000), (int)(bootTiming.firstSend / 1000));
+  }
+}
@@ -0,0 +1,139 @@
+#pragma once
+#include <Preferences.h>
+#include "esp_camera.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "frame_stream.h"
+#include "camera_control.h"
+#include "tensor_stream.h"
+
+// Values of BUFFER_CALIBRATION_GOAL
+#define CALIBRATE_LATENCY 0    // freshest frames
+#define CALIBRATE_THROUGHPUT 1 // most frames per second
+
+// Frames measured per candidate, after the warm-up frames are discarded
+#define CALIBRATION_FRAMES 30
+#define CALIBRATION_WARMUP 5
+// Time each frame is held before it is returned, standing in for sending it
+#define CALIBRATION_HOLD_MS 15
+#define CALIBRATION_MAX_BUFFERS 3
+// Fraction of the best frame rate measured a candidate has to reach,
+// latency decides between those that do
+#if BUFFER_CALIBRATION_GOAL == CALIBRATE_LATENCY
+#define CALIBRATION_MIN_FPS 0.8
+#else
+#define CALIBRATION_MIN_FPS 0.97
+#endif
+#define CALIBRATION_NAMESPACE "camera"
+
+// The pipeline holds this many frame buffers at once
+#define CALIBRATION_MIN_BUFFERS PIPELINE_FRAME_BUFFERS
+static_assert(!BUFFER_CALIBRATION || CALIBRATION_MIN_BUFFERS <= CALIBRATION_MAX_BUFFERS,
+              "The pipeline holds more frame buffers than BUFFER_CALIBRATION tries");
+
+// Result of a calibration, stored in NVS. It is only reused for the same
+// goal and frame size.
+struct BufferChoice {
+  uint8_t fbCount;
+  uint8_t grabMode; // camera_grab_mode_t
+  uint8_t goal;
+  uint8_t framesize;
+};
+
+struct BufferMeasurement {
+  float fps;
+  float latency; // ms from the end of the capture until handed to us
+};
+
+static bool measureBuffers(const BufferChoice &choice, BufferMeasurement &result) {
+  if (!createCameraConfiguration(choice.fbCount, (camera_grab_mode_t)choice.grabMode, CAMERA_PIXFORMAT)) {
+    return false;
+  }
+  int64_t start = 0;
+  float latency = 0;
+  bool ok = true;
+  for (int i = 0; i < CALIBRATION_WARMUP + CALIBRATION_FRAMES && ok; i++) {
+    if (i == CALIBRATION_WARMUP) {
+      start = esp_timer_get_time();
+    }
+    camera_fb_t *fb = esp_camera_fb_get();
+    ok = fb != NULL;
+    if (ok) {
+      if (i >= CALIBRATION_WARMUP) {
+        latency += (esp_timer_get_time() - (int64_t)frameTimestamp(fb)) / 1000.0;
+      }
+      vTaskDelay(pdMS_TO_TICKS(CALIBRATION_HOLD_MS));
+      esp_camera_fb_return(fb);
+    }
+  }
+  result.fps = CALIBRATION_FRAMES * 1000000.0 / (esp_timer_get_time() - start);
+  result.latency = latency / CALIBRATION_FRAMES;
+  esp_camera_deinit();
+  return ok;
+}
+
+// Tries every buffer count and grab mode the pipeline can work with. Of
+// the candidates that reach the frame rate the goal asks for, relative to
+// the best one measured, the one with the lowest latency is chosen.
+static BufferChoice calibrateBuffers() {
+  BufferChoice candidates[2 * CALIBRATION_MAX_BUFFERS];
+  BufferMeasurement results[2 * CALIBRATION_MAX_BUFFERS];
+  int count = 0;
+  float bestFps = 0;
+  for (uint8_t buffers = CALIBRATION_MIN_BUFFERS; buffers <= CALIBRATION_MAX_BUFFERS; buffers++) {
+    for (int mode = CAMERA_GRAB_WHEN_EMPTY; mode <= CAMERA_GRAB_LATEST; mode++) {
+      // GRAB_LATEST needs a second buffer to fill while we hold one
+      if (buffers == 1 && mode == CAMERA_GRAB_LATEST) {
+        continue;
+      }
+      BufferChoice &candidate = candidates[count];
+      candidate = { buffers, (uint8_t)mode, BUFFER_CALIBRATION_GOAL, (uint8_t)board.streamFramesize };
+      if (!measureBuffers(candidate, results[count])) {
+        Serial.printf("Calibration: %d buffers, grab mode %d failed\n", buffers, mode);
+        continue;
+      }
+      Serial.printf("Calibration: %d buffers, grab mode %d: %.1f fps, %.1f ms\n",
+                    buffers, mode, results[count].fps, results[count].latency);
+      bestFps = max(bestFps, results[count].fps);
+      count++;
+    }
+  }
+
+  BufferChoice best = { cameraFbCount, (uint8_t)board.grabMode, BUFFER_CALIBRATION_GOAL,
+                        (uint8_t)board.streamFramesize };
+  float bestLatency = 0;
+  for (int i = 0; i < count; i++) {
+    if (results[i].fps >= bestFps * CALIBRATION_MIN_FPS &&
+        (bestLatency == 0 || results[i].latency < bestLatency)) {
+      best = candidates[i];
+      bestLatency = results[i].latency;
+    }
+  }
+  return best;
+}
+
+// Initializes the camera. With BUFFER_CALIBRATION the frame buffer count
+// and grab mode are measured the first time and then read from NVS.
+bool initCamera() {
+#if BUFFER_CALIBRATION
+  // Without PSRAM there is only room for a single buffer
+  if (cameraHasPsram()) {
+    Preferences prefs;
+    BufferChoice choice;
+    bool stored = prefs.begin(CALIBRATION_NAMESPACE, true) &&
+                  prefs.getBytes("buffers", &choice, sizeof(choice)) == sizeof(choice);
+    prefs.end();
+    if (!stored || choice.goal != BUFFER_CALIBRATION_GOAL || choice.framesize != board.streamFramesize ||
+        choice.fbCount < CALIBRATION_MIN_BUFFERS) {
+      choice = calibrateBuffers();
+      if (prefs.begin(CALIBRATION_NAMESPACE, false)) {
+        prefs.putBytes("buffers", &choice, sizeof(choice));
+        prefs.end();
+      }
+    }
+    Serial.printf("Using %d frame buffers, grab mode %d\n", choice.fbCount, choice.grabMode);
+    return createCameraConfiguration(choice.fbCount, (camera_grab_mode_t)choice.grabMode, CAMERA_PIXFORMAT);
+  }
+#endif
+  return createCameraConfiguration(cameraFbCount, board.grabMode, CAMERA_PIXFORMAT);
+}
@@ -6,66 +6,389 @@
 #define SSID ""
 // WiFi password
 #define WIFI_PASSWORD ""
+// Transmit power, see wifi_power_t
+#define WIFI_TX_POWER WIFI_POWER_19_5dBm
+// 802.11 modes to connect with
+#define WIFI_PROTOCOLS (WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N)
+// Use a fixed address instead of asking for one over DHCP
+#define STATIC_IP 0
+#define STATIC_IP_ADDRESS 192, 168, 1, 50
+#define STATIC_IP_GATEWAY 192, 168, 1, 1
+#define STATIC_IP_SUBNET 255, 255, 255, 0
 // TCP port
 #define PORT 1234
+// Accept firmware updates over Wi-Fi as OTA_HOSTNAME.local, protected by
+// OTA_PASSWORD unless it is empty (see ota_update.h)
+#define OTA_UPDATES 0
+#define OTA_HOSTNAME "esp32-camera"
+#define OTA_PASSWORD ""
+// Name of this build, sent with every StatsRecord so clients can compare
+// variants running on different cameras. Set by tools/build_variants.sh.
+#define FIRMWARE_VARIANT "default"
+// Also stream frames as UDP datagrams on UDP_PORT (see udp_stream.h)
+#define UDP_STREAM 0
+#define UDP_PORT 1235
 // Frames Per Second
 #define FPS 30.0
+// Clock, exposure and gain tuning of the sensor: SENSOR_PROFILE_DEFAULT,
+// SENSOR_PROFILE_MAX_FPS, SENSOR_PROFILE_LOW_LIGHT or
+// SENSOR_PROFILE_LOW_BANDWIDTH (see sensor_profiles.h). Clients can switch
+// with CONTROL_SET_SENSOR_PROFILE.
+#define SENSOR_PROFILE SENSOR_PROFILE_DEFAULT
+// Only stream this region of the sensor, in pixels of its full resolution,
+// at full detail (see camera_roi.h). OV2640 only. Clients can move it with
+// CONTROL_SET_ROI, a new frame size replaces it.
+#define ROI 0
+#define ROI_X 400
+#define ROI_Y 304
+#define ROI_WIDTH 800
+#define ROI_HEIGHT 592
+// Serve a second stream with its own frame size, quality and rate on
+// SECONDARY_PORT. Both streams are captured in turns by the same sensor
+// (see multi_stream.h). Needs PIPELINE_TASKS, and takes FRAMES_IN_FLIGHT
+// more frame buffers than a single stream.
+#define MULTI_STREAM 0
+#define SECONDARY_PORT 1236
+#define SECONDARY_FRAMESIZE FRAMESIZE_QVGA
+#define SECONDARY_QUALITY 20
+#define SECONDARY_FPS 5.0
+// Prefix every frame with a FrameHeader (see stream_protocol.h). Set to 0
+// for the raw stream of back to back JPEG images.
+#define FRAMED_STREAM 0
+// Follow every frame with a MESSAGE_FRAME_SENT telling when its last byte
+// was written, for monitoring latency with CONTROL_PING. Needs
+// FRAMED_STREAM.
+#define FRAME_SENT_STAMPS 0
+// Set the clock from SNTP_SERVER, pongs then also carry the offset of the
+// frame timestamps to Unix time (see clock_sync.h)
+#define SNTP 0
+#define SNTP_SERVER "pool.ntp.org"
+// Stream TENSOR_WIDTH x TENSOR_HEIGHT grayscale images instead of JPEG,
+// for clients running inference (see tensor_stream.h). The camera captures
+// 240x240 frames in TENSOR_PIXFORMAT, PIXFORMAT_GRAYSCALE or
+// PIXFORMAT_YUV422, which are scaled down on the device.
+#define TENSOR_STREAM 0
+#define TENSOR_PIXFORMAT PIXFORMAT_GRAYSCALE
+#define TENSOR_WIDTH 96
+#define TENSOR_HEIGHT 96
+// Leave the JPEG header out of frames whose header is the same as the one
+// the client received last (see stream_protocol.h). Needs FRAMED_STREAM.
+#define COMPACT_JPEG 0
+// Number of clients served at the same time. Every client receives the
+// same captured frames.
+#define MAX_CLIENTS 4
+// Run capture and network I/O as separate tasks on separate cores. When 0,
+// both run one after another in loop().
+#define PIPELINE_TASKS 1
+#define CAPTURE_CORE 1
+// The WiFi stack runs on core 0
+#define NETWORK_CORE 0
+// Frames waiting to be sent, must be lower than the camera's fb_count
+#define FRAME_QUEUE_LENGTH 1
+// QUEUE_DROP_OLDEST or QUEUE_BLOCK
+#define FRAME_QUEUE_POLICY QUEUE_DROP_OLDEST
+// Frames clients may be writing at the same time. Every one holds a camera
+// frame buffer, so together with FRAME_QUEUE_LENGTH it must not exceed
+// fb_count. A client still writing an earlier frame skips new ones.
+#define FRAMES_IN_FLIGHT 1
+// Camera frame buffers on boards with PSRAM. 0 takes the board profile's
+// count, raised to the FRAME_QUEUE_LENGTH + FRAMES_IN_FLIGHT per stream
+// the pipeline holds (see board_profile.h).
+#define FRAME_BUFFERS 0
+// Write up to this many live frames to a client with a single send, for
+// small frames where every send costs about as much as the data it carries.
+// A batch goes out once it reaches COALESCE_MAX_BYTES or its oldest frame
+// has waited COALESCE_MAX_DELAY_MS. 1 sends every frame on its own. Must
+// not exceed FRAMES_IN_FLIGHT.
+#define COALESCE_FRAMES 1
+#define COALESCE_MAX_BYTES 4096
+#define COALESCE_MAX_DELAY_MS 20
+// Set TCP_NODELAY on client connections, so the tail of a frame leaves
+// without waiting for the acknowledgement of the previous segment
+#define CLIENT_NODELAY 0
+// Measure frame rate and latency with every frame buffer count and grab
+// mode on the first boot, and use the best one for BUFFER_CALIBRATION_GOAL
+// (CALIBRATE_LATENCY or CALIBRATE_THROUGHPUT) from then on
+#define BUFFER_CALIBRATION 0
+#define BUFFER_CALIBRATION_GOAL CALIBRATE_LATENCY
+// Lower JPEG quality, and then frame size, when frames take longer than
+// ABR_TARGET_LATENCY_MS (see bitrate_controller.h) to reach the clients.
+#define ADAPTIVE_BITRATE 0
+// Push a statistics record to every client this often (ms), 0 to only
+// send them when requested with CONTROL_GET_STATS. Needs FRAMED_STREAM.
+#define STATS_INTERVAL_MS 0
+// Only stream while something moves, plus a frame every
+// MOTION_KEEPALIVE_MS otherwise (see motion_detector.h)
+#define MOTION_GATING 0
+// Mean change of the average brightness of a grid cell (0 to 255) that
+// counts as motion
+#define MOTION_THRESHOLD 8
+// Bytes of PSRAM recording the most recent frames, which clients can ask to
+// replay with CONTROL_REPLAY. 0 disables recording.
+#define FRAME_RING_SIZE 0
+// Replay this many milliseconds to every client when motion starts, 0 to
+// only replay on request
+#define REPLAY_ON_MOTION_MS 0
+// Internal RAM kept free for Wi-Fi and lwIP on top of every client's send
+// buffer. Frame buffers, the frame ring and the SD card spool are made
+// smaller or left out rather than eat into it (see memory_budget.h).
+#define MEMORY_RESERVE_KB 40
+// Store frames on the SD card while Wi-Fi is down or the clients are gone,
+// and send them to the first client once one is back, at most
+// SPOOL_DRAIN_RATE bytes per second next to the live frames (see
+// sd_spool.h). Needs FRAMED_STREAM and PSRAM.
+#define SD_SPOOL 0
+#define SPOOL_MAX_BYTES (256 * 1024 * 1024)
+#define SPOOL_DRAIN_RATE (200 * 1024)
+// Lower the frame rate of the primary stream from FPS down to
+// GOVERNOR_MIN_FPS while the chip is hotter than GOVERNOR_MAX_TEMP_C or the
+// supply is below GOVERNOR_MIN_SUPPLY_MV, and the CPU clock with the load
+// of the capture and network tasks (see power_governor.h)
+#define POWER_GOVERNOR 0
+#define GOVERNOR_MIN_FPS 2.0
+#define GOVERNOR_MAX_TEMP_C 75
+// ADC pin measuring the supply through a 1:GOVERNOR_SUPPLY_DIVIDER voltage
+// divider, -1 if the board has none
+#define GOVERNOR_SUPPLY_PIN -1
+#define GOVERNOR_SUPPLY_DIVIDER 2
+#define GOVERNOR_MIN_SUPPLY_MV 3500
 
-WiFiServer server(PORT);
+#include "frame_fanout.h"
+#include "frame_pipeline.h"
+#include "control_channel.h"
+#include "bitrate_controller.h"
+#include "udp_stream.h"
+#include "motion_detector.h"
+#include "multi_stream.h"
+#include "wifi_tuning.h"
+#include "boot_timing.h"
+#include "tensor_stream.h"
+#include "power_governor.h"
+#include "ota_update.h"
+
+FanoutServer fanout = { -1 };
+#if MULTI_STREAM
+FanoutServer secondaryFanout = { -1 };
+MultiStream multiStream;
+// Indexed by CapturedFrame::stream
+FanoutServer *fanouts[STREAM_COUNT] = { &fanout, &secondaryFanout };
+#else
+FanoutServer *fanouts[STREAM_COUNT] = { &fanout };
+#endif
+UdpStream udpStream = { -1 };
+MotionDetector motion;
+FrameRing frameRing;
+SdSpool spool;
+FramePacer pacer;
+BitrateController bitrate;
+WifiLink wifiLink;
+PowerGovernor governor;
+
+void onFrameSent(const SharedFrame &frame, int64_t now) {
+  bootFrameSent();
+#if ADAPTIVE_BITRATE
+  bitrateFrameSent(bitrate, frame.fb->len, frame.header.timestamp, frame.published, now);
+#endif
+}
+
+bool serviceClients() {
+  wifiMaintain(wifiLink);
+#if OTA_UPDATES
+  otaHandle();
+#endif
+  memoryCheck();
+  for (int i = 0; i < STREAM_COUNT; i++) {
+    fanoutAccept(*fanouts[i]);
+  }
+  spoolUpdate(spool, wifiLink.connected, fanoutClientCount(fanout));
+#if POWER_GOVERNOR && MULTI_STREAM
+  governorUpdate(governor, multiStream.profiles[0].pacer.targetFps);
+#elif POWER_GOVERNOR
+  governorUpdate(governor, pacer.targetFps);
+#endif
+#if MOTION_GATING && REPLAY_ON_MOTION_MS > 0
+  static uint32_t motionOnsets = 0;
+  if (motion.onsets != motionOnsets) {
+    motionOnsets = motion.onsets;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+      if (fanout.slots[i].active) {
+        fanoutReplay(fanout, fanout.slots[i], REPLAY_ON_MOTION_MS);
+      }
+    }
+  }
+#endif
+  udpPoll(udpStream);
+  bool progress = false;
+  for (int i = 0; i < STREAM_COUNT; i++) {
+    controlPoll(*fanouts[i]);
+    statsPeriodic(*fanouts[i]);
+    progress |= fanoutService(*fanouts[i]);
+  }
+  return progress;
+}
+
+void waitForEvents(int timeoutMs) {
+  EventSet events;
+  eventsBegin(events);
+  for (int i = 0; i < STREAM_COUNT; i++) {
+    fanoutWatch(*fanouts[i], events);
+    timeoutMs = fanoutBatchWait(*fanouts[i], timeoutMs);
+  }
+  udpWatch(udpStream, events);
+  eventsWait(events, timeoutMs);
+}
+
+bool streamWanted() {
+  // The ring records even while nobody is connected, the spool while
+  // nobody can be
+  bool wanted = frameRing.size > 0 || spool.outage || fanoutClientCount(fanout) > 0 ||
+                udpSubscribed(udpStream);
+#if MULTI_STREAM
+  multiStream.wanted[0] = wanted;
+  multiStream.wanted[1] = fanoutClientCount(secondaryFanout) > 0;
+  wanted |= multiStream.wanted[1];
+#endif
+  return wanted;
+}
+
+bool keepFrame(CapturedFrame &frame) {
+  bootFrameCaptured();
+#if TENSOR_STREAM
+  if (!tensorFrame(frame)) {
+    return false;
+  }
+#endif
+  // Recording and motion gating only look at the primary stream
+  if (frame.stream != 0) {
+    return true;
+  }
+  if (frameRing.size > 0) {
+    ringRecord(frameRing, frame);
+  }
+#if MOTION_GATING
+  if (!motionGate(motion, frame.fb)) {
+    statsCount(COUNTER_FRAMES_GATED);
+    return false;
+  }
+#endif
+  spoolRecord(spool, frame);
+  return true;
+}
+
+void publishFrame(const CapturedFrame &frame) {
+  if (frame.stream == 0) {
+    udpPublish(udpStream, frame);
+  }
+  fanoutPublish(*fanouts[frame.stream], frame);
+}
 
 void setup() {
   Serial.begin(115200);
   Serial.setDebugOutput(true);
+  Serial.printf("Firmware variant %s\n", FIRMWARE_VARIANT);
+  pacerSetFps(pacer, FPS);
+  fanout.frameSent = onFrameSent;
+  fanout.ring = &frameRing;
+  memoryRecord("fan-out", sizeof(FanoutServer) * STREAM_COUNT, 0);
+  MemoryMark mark = memoryMark();
 
-  // Initialize camera
-  bool cameraConfigured = createCameraConfiguration();
+  // Initialize the camera while WiFi connects, both take hundreds of ms
+  bootStartCamera();
+  wifiConnect(wifiLink, SSID, WIFI_PASSWORD, bootWifiStarted);
+  bootWifiReady();
+  clockBegin();
+#if OTA_UPDATES
+  otaBegin(OTA_HOSTNAME, OTA_PASSWORD);
+#endif
 
-  if (!cameraConfigured) {
+  if (!bootWaitCamera()) {
     return;
   }
-
-  // Connect to WiFi
-  WiFi.begin(SSID, WIFI_PASSWORD);
-
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(1000);
-    Serial.println("Connecting to WiFi...");
-  }
+  memoryRecordSince("Wi-Fi and drivers", mark);
+  // Applied before the first capture
+  CameraSettings initial = { -1, -1, -1 };
+  initial.setRoi = ROI;
+  initial.roi = { ROI_X, ROI_Y, ROI_WIDTH, ROI_HEIGHT };
+  initial.setSensorProfile = SENSOR_PROFILE != SENSOR_PROFILE_DEFAULT;
+  initial.sensorProfile = SENSOR_PROFILE;
+  requestSettings(0, initial);
+#if MULTI_STREAM
+  sensor_t *s = esp_camera_sensor_get();
+  profileBegin(multiStream.profiles[0], s->status.framesize, s->status.quality, FPS);
+  profileBegin(multiStream.profiles[1], SECONDARY_FRAMESIZE, SECONDARY_QUALITY, SECONDARY_FPS);
+  secondaryFanout.stream = 1;
+#endif
+#if FRAME_RING_SIZE > 0
+  ringBegin(frameRing, FRAME_RING_SIZE);
+#endif
 
   // Start TCP server
-  server.begin();
+  mark = memoryMark();
+  fanoutBegin(fanout, PORT);
   Serial.printf("Server started on port %d\n", PORT);
   Serial.print("Address: "); Serial.println(WiFi.localIP());
+#if MULTI_STREAM
+  fanoutBegin(secondaryFanout, SECONDARY_PORT);
+  Serial.printf("Secondary stream on port %d\n", SECONDARY_PORT);
+#endif
+#if UDP_STREAM
+  udpBegin(udpStream, UDP_PORT);
+#endif
+#if SD_SPOOL
+  if (spoolBegin(spool, SPOOL_MAX_BYTES, SPOOL_DRAIN_RATE)) {
+    fanout.spool = &spool;
+  }
+#endif
+
+  governorBegin(governor, FPS);
+#if PIPELINE_TASKS && MULTI_STREAM
+  startPipeline(multiStream);
+#elif PIPELINE_TASKS
+  startPipeline(pacer);
+#endif
+  memoryRecordSince("sockets and tasks", mark);
+  bootStreamReady();
+  memoryReport();
 }
 
 void loop() {
-  WiFiClient client = server.available();
-  if (client) {
-    Serial.print("New client connected: ");
-    Serial.println(client.remoteIP());
-    while (client.connected()) {
-
-      // Capture image
-      camera_fb_t *fb = esp_camera_fb_get();
-      if (!fb) {
-        Serial.println("Failed to capture image");
-        break;
-      }
-
-      // Send image data over TCP
-      if (client.write(fb->buf, fb->len) != fb->len) {
-        Serial.println("Error sending image");
-      }
+#if PIPELINE_TASKS
+  // Capture and network tasks do all the work
+  vTaskDelete(NULL);
+#endif
+  bool progress = serviceClients();
+  if (!streamWanted()) {
+    pacerReset(pacer);
+    waitForEvents(EVENT_WAIT_MS);
+    return;
+  }
 
-      // Free image buffer
-      esp_camera_fb_return(fb);
-      
-      // Delay between frames (adjust as needed)
-      delay(1000.0 / FPS);
+  // Don't block in esp_camera_fb_get() while clients hold all buffers
+  bool ready = fanoutReady(fanout) || udpSubscribed(udpStream) || frameRing.size > 0 || spool.outage;
+  if (!ready || !pacerDue(pacer)) {
+    if (!progress) {
+      // Sleep until a client can take more data or the next frame is due,
+      // rounded up so the last millisecond isn't spent polling
+      int wait = ready ? (pacerTimeToDue(pacer) + 999) / 1000 : EVENT_WAIT_MS;
+      waitForEvents(min(wait, EVENT_WAIT_MS));
     }
+    return;
+  }
+
+  applyPendingSettings(pacer);
 
-    // Close client connection
-    client.stop();
-    Serial.println("Client disconnected");
+  // Capture image
+  CapturedFrame frame;
+  if (!captureFrame(frame)) {
+    Serial.println("Failed to capture image");
+    return;
+  }
+  if (!keepFrame(frame)) {
+    esp_camera_fb_return(frame.fb);
+    return;
   }
-}
\ No newline at end of file
+
+  // Hand the image to every client, it's written by fanoutService()
+  publishFrame(frame);
+  fanoutService(fanout);
+}
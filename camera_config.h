@@ -1,59 +1,67 @@
 #define CAMERA_MODEL_AI_THINKER // Has PSRAM
 #include "esp_camera.h"
-#include "camera_pins.h"
+#include "board_profile.h"
+
+// Largest frame size the frame buffers were allocated for
+framesize_t cameraMaxFramesize;
+
+// The largest frame size up to `framesize` whose `fbCount` frame buffers
+// fit in memory (see memory_budget.h)
+framesize_t budgetCameraBuffers(framesize_t framesize, uint8_t fbCount, pixformat_t format, bool psram);
+
+// Whether the board really has PSRAM. Modules are sold with and without.
+bool cameraHasPsram() {
+  return board.psram && psramFound();
+}
+
+// Initializes the camera with `fbCount` frame buffers, which are filled
+// according to `grabMode`. Boards without PSRAM always get one buffer.
+bool createCameraConfiguration(uint8_t fbCount, camera_grab_mode_t grabMode, pixformat_t format) {
+  const BoardProfile &profile = cameraHasPsram() ? board : boardWithoutPsram;
+  if (profile.psram != board.psram) {
+    Serial.println("PSRAM not found, using a single frame buffer in DRAM");
+  }
+  if (!profile.psram) {
+    fbCount = profile.fbCount;
+    grabMode = profile.grabMode;
+  }
 
-bool createCameraConfiguration() {
   camera_config_t config;
   config.ledc_channel = LEDC_CHANNEL_0;
   config.ledc_timer = LEDC_TIMER_0;
-  config.pin_d0 = Y2_GPIO_NUM;
-  config.pin_d1 = Y3_GPIO_NUM;
-  config.pin_d2 = Y4_GPIO_NUM;
-  config.pin_d3 = Y5_GPIO_NUM;
-  config.pin_d4 = Y6_GPIO_NUM;
-  config.pin_d5 = Y7_GPIO_NUM;
-  config.pin_d6 = Y8_GPIO_NUM;
-  config.pin_d7 = Y9_GPIO_NUM;
-  config.pin_xclk = XCLK_GPIO_NUM;
-  config.pin_pclk = PCLK_GPIO_NUM;
-  config.pin_vsync = VSYNC_GPIO_NUM;
-  config.pin_href = HREF_GPIO_NUM;
-  config.pin_sccb_sda = SIOD_GPIO_NUM;
-  config.pin_sccb_scl = SIOC_GPIO_NUM;
-  config.pin_pwdn = PWDN_GPIO_NUM;
-  config.pin_reset = RESET_GPIO_NUM;
+  config.pin_d0 = profile.pins.data[0];
+  config.pin_d1 = profile.pins.data[1];
+  config.pin_d2 = profile.pins.data[2];
+  config.pin_d3 = profile.pins.data[3];
+  config.pin_d4 = profile.pins.data[4];
+  config.pin_d5 = profile.pins.data[5];
+  config.pin_d6 = profile.pins.data[6];
+  config.pin_d7 = profile.pins.data[7];
+  config.pin_xclk = profile.pins.xclk;
+  config.pin_pclk = profile.pins.pclk;
+  config.pin_vsync = profile.pins.vsync;
+  config.pin_href = profile.pins.href;
+  config.pin_sccb_sda = profile.pins.sda;
+  config.pin_sccb_scl = profile.pins.scl;
+  config.pin_pwdn = profile.pins.pwdn;
+  config.pin_reset = profile.pins.reset;
   config.xclk_freq_hz = 20000000;
-  config.frame_size = FRAMESIZE_UXGA;
-  config.pixel_format = PIXFORMAT_JPEG; // for streaming
-  config.grab_mode = CAMERA_GRAB_WHEN_EMPTY;
-  config.fb_location = CAMERA_FB_IN_PSRAM;
-  config.jpeg_quality = 12;
-  config.fb_count = 1;
-  
-  // if PSRAM IC present, init with UXGA resolution and higher JPEG quality
-  //                      for larger pre-allocated frame buffer.
-  if(config.pixel_format == PIXFORMAT_JPEG){
-    if(psramFound()){
-      config.jpeg_quality = 10;
-      config.fb_count = 2;
-      config.grab_mode = CAMERA_GRAB_LATEST;
-    } else {
-      // Limit the frame size when PSRAM is not available
-      config.frame_size = FRAMESIZE_SVGA;
-      config.fb_location = CAMERA_FB_IN_DRAM;
-    }
-  } else {
-    // Best option for face detection/recognition
+  config.frame_size = profile.framesize;
+  config.pixel_format = format;
+  config.grab_mode = grabMode;
+  config.fb_location = profile.psram ? CAMERA_FB_IN_PSRAM : CAMERA_FB_IN_DRAM;
+  config.jpeg_quality = profile.jpegQuality;
+  config.fb_count = fbCount;
+  // Uncompressed frames are kept small, for machine learning clients
+  if (format != PIXFORMAT_JPEG) {
     config.frame_size = FRAMESIZE_240X240;
-#if CONFIG_IDF_TARGET_ESP32S3
-    config.fb_count = 2;
-#endif
   }
+  config.frame_size = budgetCameraBuffers(config.frame_size, fbCount, format, profile.psram);
 
-#if defined(CAMERA_MODEL_ESP_EYE)
-  pinMode(13, INPUT_PULLUP);
-  pinMode(14, INPUT_PULLUP);
-#endif
+  if (profile.dataPullups) {
+    pinMode(profile.pins.data[1], INPUT_PULLUP);
+    pinMode(profile.pins.data[2], INPUT_PULLUP);
+  }
 
   // camera init
   esp_err_t err = esp_camera_init(&config);
@@ -61,6 +69,7 @@ bool createCameraConfiguration() {
     Serial.printf("Camera init failed with error 0x%x", err);
     return false;
   }
+  cameraMaxFramesize = config.frame_size;
 
   sensor_t * s = esp_camera_sensor_get();
   // initial sensors are flipped vertically and colors are a bit saturated
@@ -70,18 +79,15 @@ bool createCameraConfiguration() {
     s->set_saturation(s, -2); // lower the saturation
   }
   // drop down frame size for higher initial frame rate
-  if(config.pixel_format == PIXFORMAT_JPEG){
-    s->set_framesize(s, FRAMESIZE_QVGA);
+  if (format == PIXFORMAT_JPEG) {
+    s->set_framesize(s, profile.streamFramesize < config.frame_size ? profile.streamFramesize : config.frame_size);
+  }
+  if (profile.vflip) {
+    s->set_vflip(s, 1);
+  }
+  if (profile.hmirror) {
+    s->set_hmirror(s, 1);
   }
-
-#if defined(CAMERA_MODEL_M5STACK_WIDE) || defined(CAMERA_MODEL_M5STACK_ESP32CAM)
-  s->set_vflip(s, 1);
-  s->set_hmirror(s, 1);
-#endif
-
-#if defined(CAMERA_MODEL_ESP32S3_EYE)
-  s->set_vflip(s, 1);
-#endif
 
   return true;
-}
\ No newline at end of file
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include "esp_camera.h"
+#include "freertos/FreeRTOS.h"
+#include "board_profile.h"
+#include "frame_pacer.h"
+#include "camera_roi.h"
+#include "sensor_profiles.h"
+
+// Camera settings changed at runtime. Fields left at -1 are not changed.
+struct CameraSettings {
+  int framesize; // framesize_t
+  int quality;   // JPEG quality, 0 (best) to 63
+  float fps;
+  bool setRoi;   // change the region of interest to `roi`
+  Roi roi;
+  bool setSensorProfile; // switch to `sensorProfile`, for every stream
+  uint8_t sensorProfile; // SensorProfile
+};
+
+// Streams with their own settings (see multi_stream.h)
+#if MULTI_STREAM
+#define STREAM_COUNT 2
+#else
+#define STREAM_COUNT 1
+#endif
+
+// Frame buffers held at once: queued frames and the frames being sent on
+// every stream
+#define PIPELINE_FRAME_BUFFERS (FRAME_QUEUE_LENGTH + STREAM_COUNT * FRAMES_IN_FLIGHT)
+// Frame buffers the camera is initialized with, see FRAME_BUFFERS
+constexpr uint8_t cameraFbCount = !board.psram ? board.fbCount
+                                  : FRAME_BUFFERS > 0 ? FRAME_BUFFERS
+                                  : board.fbCount < PIPELINE_FRAME_BUFFERS ? PIPELINE_FRAME_BUFFERS
+                                                                           : board.fbCount;
+
+// Settings are requested by the network side and applied by whoever
+// captures, right before the next esp_camera_fb_get(), so the sensor is
+// never reconfigured while a capture is in progress.
+static portMUX_TYPE settingsLock = portMUX_INITIALIZER_UNLOCKED;
+static CameraSettings pendingSettings[STREAM_COUNT];
+static volatile bool settingsPending[STREAM_COUNT];
+
+void requestSettings(int stream, const CameraSettings &changes) {
+  portENTER_CRITICAL(&settingsLock);
+  CameraSettings &pending = pendingSettings[stream];
+  if (!settingsPending[stream]) {
+    pending = { -1, -1, -1 };
+  }
+  if (changes.framesize >= 0) {
+    pending.framesize = changes.framesize;
+    // The new frame size replaces the region of interest
+    pending.setRoi = false;
+  }
+  if (changes.quality >= 0) {
+    pending.quality = changes.quality;
+  }
+  if (changes.fps > 0) {
+    pending.fps = changes.fps;
+  }
+  if (changes.setRoi) {
+    pending.setRoi = true;
+    pending.roi = changes.roi;
+  }
+  if (changes.setSensorProfile) {
+    pending.setSensorProfile = true;
+    pending.sensorProfile = changes.sensorProfile;
+  }
+  settingsPending[stream] = true;
+  portEXIT_CRITICAL(&settingsLock);
+}
+
+// Takes the settings requested for `stream` since the last call, returns
+// false if there are none.
+bool takePendingSettings(int stream, CameraSettings &settings) {
+  if (!settingsPending[stream]) {
+    return false;
+  }
+  portENTER_CRITICAL(&settingsLock);
+  settings = pendingSettings[stream];
+  settingsPending[stream] = false;
+  portEXIT_CRITICAL(&settingsLock);
+  return true;
+}
+
+void applyPendingSettings(FramePacer &pacer) {
+  CameraSettings settings;
+  if (!takePendingSettings(0, settings)) {
+    return;
+  }
+
+  sensor_t *s = esp_camera_sensor_get();
+  if (settings.framesize >= 0) {
+    s->set_framesize(s, (framesize_t)settings.framesize);
+    Serial.printf("Frame size set to %d\n", settings.framesize);
+  }
+  // Set after the frame size, which would replace the window
+  if (settings.setRoi) {
+    if (applyRoi(s, settings.roi)) {
+      Serial.printf("Region of interest set to %dx%d at %d,%d\n", settings.roi.width, settings.roi.height,
+                    settings.roi.x, settings.roi.y);
+    } else {
+      Serial.println("Failed to set region of interest");
+    }
+  }
+  if (settings.setSensorProfile) {
+    if (applySensorProfile(s, settings.sensorProfile)) {
+      Serial.printf("Sensor profile set to %d\n", settings.sensorProfile);
+    } else {
+      Serial.println("Failed to set sensor profile");
+    }
+  } else if (settings.framesize >= 0 || settings.setRoi) {
+    applySensorRegisters(s);
+  }
+  if (settings.quality >= 0) {
+    s->set_quality(s, settings.quality);
+    Serial.printf("JPEG quality set to %d\n", settings.quality);
+  }
+  if (settings.fps > 0) {
+    pacerSetFps(pacer, settings.fps);
+    Serial.printf("Target FPS set to %.2f\n", settings.fps);
+  }
+}
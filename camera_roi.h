@@ -0,0 +1,62 @@
+#pragma once
+#include "esp_camera.h"
+
+#if ROI && MULTI_STREAM
+#error "ROI can't be combined with MULTI_STREAM, which switches frame sizes for every stream"
+#endif
+
+// OV2640 window offsets and sizes are programmed in units of 4 pixels, and
+// JPEG encodes in 16x16 blocks, so regions are aligned to this
+#define ROI_ALIGN 16
+// The OV2640's full resolution sensor mode (OV2640_MODE_UXGA)
+#define OV2640_MODE_FULL 0
+#define OV2640_FULL_WIDTH 1600
+#define OV2640_FULL_HEIGHT 1200
+
+// Region of interest in pixels of the sensor's full resolution. A zero
+// width means the whole image.
+struct Roi {
+  uint16_t x;
+  uint16_t y;
+  uint16_t width;
+  uint16_t height;
+};
+
+static uint16_t roiAlign(uint16_t value) {
+  return value / ROI_ALIGN * ROI_ALIGN;
+}
+
+// Whether `roi` can be cropped: it has to lie within the sensor, and the
+// frame buffers have to be able to hold the image.
+bool roiValid(const sensor_t *s, const Roi &roi) {
+  if (roi.width == 0) {
+    return true;
+  }
+  if (s->id.PID != OV2640_PID) {
+    return false;
+  }
+  const resolution_info_t &buffers = resolution[cameraMaxFramesize];
+  return roi.width >= ROI_ALIGN && roi.height >= ROI_ALIGN &&
+         roi.x + roi.width <= OV2640_FULL_WIDTH && roi.y + roi.height <= OV2640_FULL_HEIGHT &&
+         roi.width * roi.height <= buffers.width * buffers.height;
+}
+
+// Crops the image to `roi` in the sensor's DSP and encodes it unscaled.
+// The sensor keeps reading out its full resolution mode with the same line
+// timing, so frames get smaller but not faster. The window replaces the
+// frame size until set_framesize() is called again.
+// Only the OV2640 is supported, other sensors program their windows with
+// timing totals that differ per mode.
+bool applyRoi(sensor_t *s, const Roi &roi) {
+  if (roi.width == 0) {
+    return s->set_framesize(s, s->status.framesize) == 0;
+  }
+  if (!roiValid(s, roi)) {
+    return false;
+  }
+  uint16_t x = roiAlign(roi.x), y = roiAlign(roi.y);
+  uint16_t width = roiAlign(roi.width), height = roiAlign(roi.height);
+  // On the OV2640, set_res_raw() takes the sensor mode as `startX`, the
+  // window as offset and total, and the output size
+  return s->set_res_raw(s, OV2640_MODE_FULL, 0, 0, 0, x, y, width, height, width, height, false, false) == 0;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <sys/time.h>
+#include "esp_timer.h"
+#include "stream_protocol.h"
+
+// Frames are stamped with esp_timer_get_time(), microseconds since boot.
+// Clients map that to their own clock with CONTROL_PING; with SNTP the
+// device also knows the offset to Unix time, which is sent along.
+
+// Unix time before which the clock hasn't been set by SNTP yet (2020)
+#define CLOCK_VALID_AFTER 1577836800
+
+void clockBegin() {
+#if SNTP
+  configTime(0, 0, SNTP_SERVER);
+#endif
+}
+
+// Microseconds to add to a device time for microseconds since 1970, 0
+// until SNTP has set the clock.
+int64_t clockEpochOffset() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  if (now.tv_sec < CLOCK_VALID_AFTER) {
+    return 0;
+  }
+  return (int64_t)now.tv_sec * 1000000 + now.tv_usec - esp_timer_get_time();
+}
+
+void fillPong(PongRecord &pong, uint64_t clientTime) {
+  pong.clientTime = clientTime;
+  pong.received = esp_timer_get_time();
+  pong.epochOffset = clockEpochOffset();
+}
@@ -0,0 +1,181 @@
+#pragma once
+#include <string.h>
+#include "frame_fanout.h"
+#include "camera_control.h"
+#include "motion_detector.h"
+#include "clock_sync.h"
+
+// Highest frame rate a client may request
+#define CONTROL_MAX_FPS 60
+
+static void queueStats(ClientSlot &slot) {
+  StatsRecord record;
+  statsFillRecord(record);
+  fanoutQueueMessage(slot, MESSAGE_STATS, &record, sizeof(record));
+}
+
+// Status returned for commands that are answered with something else
+#define CONTROL_NO_REPLY 0xff
+
+static uint8_t handleCommand(FanoutServer &fanout, ClientSlot &slot, const ControlHeader &command,
+                             const uint8_t *payload) {
+  // Every command handled here but CONTROL_SET_ROI and CONTROL_PING
+  // carries one int32
+  int32_t value = 0;
+  bool hasValue = command.length >= sizeof(value);
+  if (hasValue) {
+    memcpy(&value, payload, sizeof(value));
+  }
+
+  CameraSettings changes = { -1, -1, -1 };
+  switch (command.opcode) {
+    case CONTROL_SET_FRAMESIZE:
+      // Frame buffers can't hold anything larger than they were allocated for
+      if (!hasValue || value < 0 || value > cameraMaxFramesize) {
+        return CONTROL_INVALID_VALUE;
+      }
+      changes.framesize = value;
+      break;
+    case CONTROL_SET_QUALITY:
+      if (!hasValue || value < 0 || value > 63) {
+        return CONTROL_INVALID_VALUE;
+      }
+      changes.quality = value;
+      break;
+    case CONTROL_SET_FPS:
+      if (!hasValue || value <= 0 || value > CONTROL_MAX_FPS * 100) {
+        return CONTROL_INVALID_VALUE;
+      }
+      changes.fps = value / 100.0;
+      break;
+    case CONTROL_SET_ROI: {
+      // The capture task of several streams reprograms the frame size
+      // between streams, which would drop the window
+#if MULTI_STREAM
+      return CONTROL_UNSUPPORTED;
+#else
+      uint16_t roi[4];
+      if (command.length < sizeof(roi)) {
+        return CONTROL_INVALID_VALUE;
+      }
+      memcpy(roi, payload, sizeof(roi));
+      changes.setRoi = true;
+      changes.roi = { roi[0], roi[1], roi[2], roi[3] };
+      sensor_t *s = esp_camera_sensor_get();
+      if (s->id.PID != OV2640_PID) {
+        return CONTROL_UNSUPPORTED;
+      }
+      if (!roiValid(s, changes.roi)) {
+        return CONTROL_INVALID_VALUE;
+      }
+      break;
+#endif
+    }
+    case CONTROL_SET_SENSOR_PROFILE:
+      if (!hasValue || value < 0 || value > SENSOR_PROFILE_LOW_BANDWIDTH) {
+        return CONTROL_INVALID_VALUE;
+      }
+      if (!findSensorTuning(esp_camera_sensor_get()->id.PID, value)) {
+        return CONTROL_UNSUPPORTED;
+      }
+      changes.setSensorProfile = true;
+      changes.sensorProfile = value;
+      break;
+    case CONTROL_PING: {
+#if FRAMED_STREAM
+      uint64_t clientTime;
+      if (command.length < sizeof(clientTime)) {
+        return CONTROL_INVALID_VALUE;
+      }
+      memcpy(&clientTime, payload, sizeof(clientTime));
+      PongRecord pong;
+      fillPong(pong, clientTime);
+      fanoutQueueMessage(slot, MESSAGE_PONG, &pong, sizeof(pong));
+      return CONTROL_NO_REPLY;
+#else
+      return CONTROL_UNSUPPORTED;
+#endif
+    }
+    case CONTROL_GET_STATS:
+      // A raw stream has nothing but JPEG images, a record in it would
+      // corrupt the next one
+#if FRAMED_STREAM
+      queueStats(slot);
+      return CONTROL_NO_REPLY;
+#else
+      return CONTROL_UNSUPPORTED;
+#endif
+    case CONTROL_REPLAY:
+      if (!hasValue || value < 0 || !fanoutReplay(fanout, slot, value)) {
+        return CONTROL_INVALID_VALUE;
+      }
+      return CONTROL_OK;
+    case CONTROL_SET_MOTION_THRESHOLD:
+      if (!hasValue || value < 0 || value > 255) {
+        return CONTROL_INVALID_VALUE;
+      }
+      motionThreshold = value;
+      return CONTROL_OK;
+    default:
+      return CONTROL_UNKNOWN_OPCODE;
+  }
+  requestSettings(fanout.stream, changes);
+  return CONTROL_OK;
+}
+
+// Sends a statistics record to every client each STATS_INTERVAL_MS.
+void statsPeriodic(FanoutServer &fanout) {
+#if FRAMED_STREAM && STATS_INTERVAL_MS > 0
+  int64_t now = esp_timer_get_time();
+  if (now - fanout.lastStats < STATS_INTERVAL_MS * 1000LL) {
+    return;
+  }
+  fanout.lastStats = now;
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    if (fanout.slots[i].active) {
+      queueStats(fanout.slots[i]);
+    }
+  }
+#endif
+}
+
+// Reads commands sent by the clients without blocking and executes them.
+// On a framed stream every command is answered with a ControlReply.
+void controlPoll(FanoutServer &fanout) {
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    ClientSlot &slot = fanout.slots[i];
+    while (slot.active) {
+      const ControlHeader &command = *(const ControlHeader *)slot.command;
+      size_t expected = sizeof(ControlHeader);
+      if (slot.commandLength >= sizeof(ControlHeader)) {
+        if (command.length > CONTROL_MAX_PAYLOAD) {
+          Serial.printf("Invalid command from client %d\n", i);
+          closeSlot(fanout, slot);
+          break;
+        }
+        expected += command.length;
+      }
+
+      if (slot.commandLength == expected) {
+        uint8_t status = handleCommand(fanout, slot, command, slot.command + sizeof(ControlHeader));
+#if FRAMED_STREAM
+        if (status != CONTROL_NO_REPLY) {
+          ControlReply reply = { command.opcode, status };
+          fanoutQueueMessage(slot, MESSAGE_CONTROL_REPLY, &reply, sizeof(reply));
+        }
+#else
+        (void)status;
+#endif
+        slot.commandLength = 0;
+        continue;
+      }
+
+      ssize_t received = recv(slot.client.fd(), slot.command + slot.commandLength,
+                              expected - slot.commandLength, MSG_DONTWAIT);
+      if (received <= 0) {
+        break;
+      }
+      slot.commandLength += received;
+    }
+  }
+}
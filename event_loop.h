@@ -0,0 +1,69 @@
+#pragma once
+#include <unistd.h>
+#include "lwip/sockets.h"
+#include "esp_vfs_eventfd.h"
+#include "task_load.h"
+
+// Longest the network side sleeps without any socket becoming ready, so
+// timeouts, periodic statistics and the Wi-Fi state are still checked
+#define EVENT_WAIT_MS 50
+
+// Sockets the network side waits on, built anew before every wait.
+struct EventSet {
+  fd_set readable;
+  fd_set writable;
+  int maxFd;
+};
+
+// Lets the capture task wake the network task when it queued a frame
+static int wakeupFd = -1;
+
+bool wakeupBegin() {
+  esp_vfs_eventfd_config_t config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+  if (esp_vfs_eventfd_register(&config) != ESP_OK || (wakeupFd = eventfd(0, 0)) < 0) {
+    Serial.println("Failed to create wakeup eventfd");
+    return false;
+  }
+  return true;
+}
+
+void wakeupSignal() {
+  if (wakeupFd >= 0) {
+    uint64_t one = 1;
+    write(wakeupFd, &one, sizeof(one));
+  }
+}
+
+void eventsBegin(EventSet &events) {
+  FD_ZERO(&events.readable);
+  FD_ZERO(&events.writable);
+  events.maxFd = -1;
+}
+
+void eventsRead(EventSet &events, int fd) {
+  if (fd >= 0) {
+    FD_SET(fd, &events.readable);
+    events.maxFd = max(events.maxFd, fd);
+  }
+}
+
+void eventsWrite(EventSet &events, int fd) {
+  if (fd >= 0) {
+    FD_SET(fd, &events.writable);
+    events.maxFd = max(events.maxFd, fd);
+  }
+}
+
+// Sleeps until a socket in `events` is ready, wakeupSignal() is called or
+// `timeoutMs` have passed.
+void eventsWait(EventSet &events, int timeoutMs) {
+  eventsRead(events, wakeupFd);
+  struct timeval timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+  int64_t start = esp_timer_get_time();
+  int ready = select(events.maxFd + 1, &events.readable, &events.writable, NULL, &timeout);
+  loadWaited(LOAD_NETWORK, esp_timer_get_time() - start);
+  if (ready > 0 && wakeupFd >= 0 && FD_ISSET(wakeupFd, &events.readable)) {
+    uint64_t count;
+    read(wakeupFd, &count, sizeof(count));
+  }
+}
@@ -0,0 +1,694 @@
+#pragma once
+#include <WiFi.h>
+#include <errno.h>
+#include "lwip/sockets.h"
+#include "lwip/opt.h"
+#include "esp_timer.h"
+#include "frame_stream.h"
+#include "frame_ring.h"
+#include "sd_spool.h"
+#include "event_loop.h"
+
+// A client that hasn't accepted a single byte for this long is dropped
+#define SEND_TIMEOUT_MS 5000
+// Largest piece of a frame offered to a socket at once, a whole number of
+// TCP segments. Clients take turns, one piece each, so a fast client can't
+// monopolize the network task.
+#define SEND_CHUNK_SIZE (4 * TCP_MSS)
+// Room for control replies waiting to be written between two frames
+#define MESSAGE_BUFFER_SIZE 512
+// Longest JPEG header compact frames can leave out
+#define JPEG_HEADER_MAX 1024
+
+#if COMPACT_JPEG && !FRAMED_STREAM
+#error "COMPACT_JPEG needs FRAMED_STREAM"
+#endif
+#if FRAME_SENT_STAMPS && !FRAMED_STREAM
+#error "FRAME_SENT_STAMPS needs FRAMED_STREAM"
+#endif
+#if COALESCE_FRAMES < 1 || COALESCE_FRAMES > FRAMES_IN_FLIGHT
+#error "COALESCE_FRAMES must be between 1 and FRAMES_IN_FLIGHT"
+#endif
+// A periodic statistics record must not crowd out the answer to a ping
+// or a command that arrived at the same time
+static_assert(MESSAGE_BUFFER_SIZE >= 3 * sizeof(FrameHeader) + sizeof(StatsRecord) + sizeof(PongRecord) +
+                                        sizeof(ControlReply),
+              "MESSAGE_BUFFER_SIZE can't hold a stats record, a pong and a control reply");
+
+// Offset of the first byte of a frame written to the socket
+#if FRAMED_STREAM
+#define FRAME_START_OFFSET 0
+#else
+#define FRAME_START_OFFSET sizeof(FrameHeader)
+#endif
+
+// A captured frame shared by every connected client. The frame buffer is
+// returned to the camera driver when the last client has released it, so
+// each additional client costs network time only, never another capture.
+struct SharedFrame {
+  camera_fb_t *fb;
+  FrameHeader header;
+  // The same frame as a MESSAGE_COMPACT_FRAME, `jpegHeaderLength` bytes
+  // shorter. 0 if it can't be sent compact.
+  FrameHeader compactHeader;
+  uint32_t jpegHeaderLength;
+  uint8_t refs;
+  int64_t published; // when the frame was handed to the clients
+};
+
+// A live frame handed to a client, with the header and payload it gets:
+// compact frames leave the JPEG header out.
+struct BatchedFrame {
+  SharedFrame *frame;
+  const FrameHeader *header;
+  const uint8_t *payload;
+};
+
+struct ClientSlot {
+  WiFiClient client;
+  bool active;
+  // Frame currently being written, NULL `header` when between frames. It
+  // is either a live frame shared with the other clients, an entry of the
+  // frame ring being replayed or backlog from the SD card spool. `offset`
+  // counts the bytes, header included, already accepted by the socket.
+  const FrameHeader *header;
+  const uint8_t *payload;
+  SharedFrame *frame;
+  bool fromRing;
+  uint32_t ringId;
+  bool fromSpool;
+  size_t offset;
+  int64_t lastProgress;
+  // Live frames not started yet, oldest first. They are written with one
+  // send once COALESCE_FRAMES have come together, they add up to
+  // COALESCE_MAX_BYTES or the oldest has waited COALESCE_MAX_DELAY_MS.
+  BatchedFrame batch[COALESCE_FRAMES];
+  uint8_t batchLength;
+  // Stamps of written frames, queued once no frame is left half written so
+  // they follow the frames in order
+  FrameSentRecord stamps[COALESCE_FRAMES];
+  uint8_t stampCount;
+  // While replaying, recorded frames starting at `replayNext` are written
+  // instead of live ones. Live frames below `liveSequence` were replayed.
+  bool replaying;
+  uint32_t replayNext;
+  uint32_t liveSequence;
+  // JPEG header the client received last with a full frame, 0 if none
+  uint32_t jpegHeaderId;
+  // Messages written before the next frame starts
+  uint8_t message[MESSAGE_BUFFER_SIZE];
+  size_t messageLength;
+  size_t messageOffset;
+  // Partially received control command
+  uint8_t command[sizeof(ControlHeader) + CONTROL_MAX_PAYLOAD];
+  size_t commandLength;
+};
+
+// A listening socket together with the clients connected to it.
+struct FanoutServer {
+  int listener; // non-blocking listening socket, -1 until fanoutBegin()
+  ClientSlot slots[MAX_CLIENTS];
+  SharedFrame frames[FRAMES_IN_FLIGHT];
+  // Recent frames clients can ask to replay, NULL if there is none
+  FrameRing *ring;
+  // Frames stored during an outage, drained to the first client. NULL if
+  // there is none.
+  SdSpool *spool;
+  // Called every time a client has written the last byte of a live frame
+  void (*frameSent)(const SharedFrame &frame, int64_t now);
+  // Header of the last frame, compact frames are sent to clients that
+  // have received it with a full frame. Changes whenever the size or
+  // quality does.
+  uint8_t jpegHeader[JPEG_HEADER_MAX];
+  uint32_t jpegHeaderLength;
+  uint32_t jpegHeaderId;
+  // Stream served, control commands change this stream's settings
+  uint8_t stream;
+  int64_t lastStats; // last periodic statistics record
+};
+
+void releaseFrame(SharedFrame &frame) {
+  if (frame.refs > 0 && --frame.refs == 0) {
+    esp_camera_fb_return(frame.fb);
+    frame.fb = NULL;
+  }
+}
+
+// Lets go of the frame the client was writing.
+static void finishFrame(FanoutServer &fanout, ClientSlot &slot) {
+  if (slot.frame) {
+    releaseFrame(*slot.frame);
+  } else if (slot.fromRing) {
+    ringUnpin(*fanout.ring, slot.ringId);
+  } else if (slot.fromSpool) {
+    spoolUnsent(*fanout.spool);
+  }
+  slot.header = NULL;
+  slot.frame = NULL;
+  slot.fromRing = false;
+  slot.fromSpool = false;
+}
+
+static void closeSlot(FanoutServer &fanout, ClientSlot &slot) {
+  if (slot.header) {
+    finishFrame(fanout, slot);
+  }
+  for (int i = 0; i < slot.batchLength; i++) {
+    releaseFrame(*slot.batch[i].frame);
+  }
+  slot.batchLength = 0;
+  slot.client.stop();
+  slot.active = false;
+}
+
+// Starts listening on `port` with a socket of our own rather than a
+// WiFiServer, so the network side can wait for connections with select().
+bool fanoutBegin(FanoutServer &fanout, uint16_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (fd < 0) {
+    Serial.println("Failed to create listening socket");
+    return false;
+  }
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, MAX_CLIENTS) < 0) {
+    Serial.printf("Failed to listen on port %d\n", port);
+    close(fd);
+    return false;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  fanout.listener = fd;
+  return true;
+}
+
+// Closes the connections of disconnected clients and accepts pending ones
+// into free slots. Connections that don't fit are closed right away.
+void fanoutAccept(FanoutServer &fanout) {
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    ClientSlot &slot = fanout.slots[i];
+    if (slot.active && !slot.client.connected()) {
+      closeSlot(fanout, slot);
+      Serial.printf("Client %d disconnected\n", i);
+    }
+  }
+
+  int fd;
+  while (fanout.listener >= 0 && (fd = accept(fanout.listener, NULL, NULL)) >= 0) {
+    WiFiClient incoming(fd);
+    int index = -1;
+    for (int i = 0; i < MAX_CLIENTS && index < 0; i++) {
+      if (!fanout.slots[i].active) {
+        index = i;
+      }
+    }
+    if (index < 0) {
+      Serial.print("Too many clients, rejecting: ");
+      Serial.println(incoming.remoteIP());
+      incoming.stop();
+      continue;
+    }
+    ClientSlot &slot = fanout.slots[index];
+#if CLIENT_NODELAY
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#endif
+    slot.client = incoming;
+    slot.active = true;
+    slot.header = NULL;
+    slot.frame = NULL;
+    slot.fromRing = false;
+    slot.fromSpool = false;
+    slot.batchLength = 0;
+    slot.stampCount = 0;
+    slot.replaying = false;
+    slot.liveSequence = 0;
+    slot.jpegHeaderId = 0;
+    slot.messageLength = 0;
+    slot.messageOffset = 0;
+    slot.commandLength = 0;
+    statsCount(COUNTER_CONNECTS);
+    Serial.printf("New client %d connected: ", index);
+    Serial.println(incoming.remoteIP());
+  }
+}
+
+int fanoutClientCount(FanoutServer &fanout) {
+  int count = 0;
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    if (fanout.slots[i].active) {
+      count++;
+    }
+  }
+  return count;
+}
+
+// Whether the client's batch of live frames is to be written now.
+static bool batchDue(const ClientSlot &slot, int64_t now) {
+  if (slot.batchLength == 0) {
+    return false;
+  }
+  size_t length = 0;
+  for (int i = 0; i < slot.batchLength; i++) {
+    length += sizeof(FrameHeader) - FRAME_START_OFFSET + slot.batch[i].header->length;
+  }
+  return slot.batchLength == COALESCE_FRAMES || length >= COALESCE_MAX_BYTES ||
+         now - slot.batch[0].frame->published >= COALESCE_MAX_DELAY_MS * 1000LL;
+}
+
+// `timeoutMs`, or less if a batch falls due before.
+int fanoutBatchWait(FanoutServer &fanout, int timeoutMs) {
+  int64_t now = esp_timer_get_time();
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    const ClientSlot &slot = fanout.slots[i];
+    if (slot.active && slot.batchLength > 0) {
+      int64_t due = slot.batch[0].frame->published + COALESCE_MAX_DELAY_MS * 1000LL;
+      timeoutMs = min(timeoutMs, (int)max((int64_t)0, (due - now + 999) / 1000));
+    }
+  }
+  return timeoutMs;
+}
+
+// Adds the sockets fanoutAccept(), controlPoll() and fanoutService() have
+// work for once they are ready: the listening socket, every client for
+// commands and disconnects, and clients with data left to write.
+void fanoutWatch(FanoutServer &fanout, EventSet &events) {
+  int64_t now = esp_timer_get_time();
+  eventsRead(events, fanout.listener);
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    ClientSlot &slot = fanout.slots[i];
+    if (!slot.active) {
+      continue;
+    }
+    eventsRead(events, slot.client.fd());
+    if (slot.header || slot.replaying || slot.messageLength > 0 || batchDue(slot, now)) {
+      eventsWrite(events, slot.client.fd());
+    }
+  }
+}
+
+// True if a newly captured frame would be sent to at least one client.
+bool fanoutReady(FanoutServer &fanout) {
+  bool freeFrame = false;
+  for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+    freeFrame = freeFrame || fanout.frames[i].refs == 0;
+  }
+  for (int i = 0; i < MAX_CLIENTS && freeFrame; i++) {
+    ClientSlot &slot = fanout.slots[i];
+    if (slot.active && !slot.header && slot.batchLength < COALESCE_FRAMES && !slot.replaying) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Trims the padding after the end of the image and prepares the compact
+// version of the frame, unless it isn't a JPEG image we can parse.
+static void compactFrame(FanoutServer &fanout, SharedFrame &frame) {
+  const uint8_t *jpeg = frame.fb->buf;
+  frame.jpegHeaderLength = 0;
+  if (frame.fb->format != PIXFORMAT_JPEG) {
+    return;
+  }
+  frame.header.length = jpegTrimmedLength(jpeg, frame.header.length);
+  uint32_t length = jpegHeaderLength(jpeg, frame.header.length);
+  if (length == 0 || length > JPEG_HEADER_MAX) {
+    return;
+  }
+  if (length != fanout.jpegHeaderLength || memcmp(jpeg, fanout.jpegHeader, length) != 0) {
+    memcpy(fanout.jpegHeader, jpeg, length);
+    fanout.jpegHeaderLength = length;
+    fanout.jpegHeaderId++;
+  }
+  frame.jpegHeaderLength = length;
+  frame.compactHeader = frame.header;
+  frame.compactHeader.type = MESSAGE_COMPACT_FRAME;
+  frame.compactHeader.length -= length;
+}
+
+// Hands the frame to every client that is between frames and returns it to
+// the driver once they have all written it. Clients still busy with an
+// earlier frame, or with a full batch, skip this one, so a slow client
+// loses whole frames instead of stalling capture or receiving a truncated
+// image. Clients replaying recorded frames skip it too, they'll get it
+// from the ring. Takes ownership of `captured.fb`.
+void fanoutPublish(FanoutServer &fanout, const CapturedFrame &captured) {
+  SharedFrame *frame = NULL;
+  for (int i = 0; i < FRAMES_IN_FLIGHT && !frame; i++) {
+    if (fanout.frames[i].refs == 0) {
+      frame = &fanout.frames[i];
+    }
+  }
+
+  if (!frame) {
+    statsCount(COUNTER_FRAMES_DROPPED, fanoutClientCount(fanout));
+    esp_camera_fb_return(captured.fb);
+    return;
+  }
+
+  frame->fb = captured.fb;
+  frame->header = captured.header;
+  frame->refs = 1; // held by fanoutPublish itself until handed out
+#if COMPACT_JPEG
+  compactFrame(fanout, *frame);
+#endif
+
+  int64_t now = esp_timer_get_time();
+  frame->published = now;
+  statsTime(STAGE_QUEUE, now - captured.grabbed);
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    ClientSlot &slot = fanout.slots[i];
+    if (!slot.active || slot.replaying || frame->header.sequence < slot.liveSequence) {
+      continue;
+    }
+    if (slot.header || slot.batchLength == COALESCE_FRAMES) {
+      statsCount(COUNTER_FRAMES_DROPPED);
+      continue;
+    }
+    frame->refs++;
+    BatchedFrame &batched = slot.batch[slot.batchLength++];
+    batched.frame = frame;
+    batched.header = &frame->header;
+    batched.payload = frame->fb->buf;
+    if (frame->jpegHeaderLength > 0) {
+      if (slot.jpegHeaderId == fanout.jpegHeaderId) {
+        batched.header = &frame->compactHeader;
+        batched.payload += frame->jpegHeaderLength;
+      }
+      slot.jpegHeaderId = fanout.jpegHeaderId;
+    }
+    if (slot.batchLength == 1 && slot.messageLength == 0) {
+      slot.lastProgress = now;
+    }
+  }
+
+  releaseFrame(*frame);
+}
+
+// Makes the client write the recorded frames of the last `milliseconds`
+// before it continues with live ones. Returns false without a frame ring.
+bool fanoutReplay(FanoutServer &fanout, ClientSlot &slot, uint32_t milliseconds) {
+  if (!fanout.ring || fanout.ring->size == 0) {
+    return false;
+  }
+  slot.replayNext = ringFind(*fanout.ring, esp_timer_get_time() - milliseconds * 1000LL);
+  slot.replaying = true;
+  return true;
+}
+
+// Starts writing the next recorded frame of a replaying client, or turns
+// it back to live frames once it has caught up with the ring.
+static void nextReplayFrame(FanoutServer &fanout, ClientSlot &slot, int64_t now) {
+  FrameRing &ring = *fanout.ring;
+  for (;;) {
+    // Entries evicted while the client was behind are skipped
+    if ((int32_t)(slot.replayNext - ring.tail) < 0) {
+      slot.replayNext = ring.tail;
+    }
+    if (slot.replayNext == ring.head) {
+      slot.replaying = false;
+      return;
+    }
+    const FrameHeader *header;
+    const uint8_t *payload;
+    if (!ringPin(ring, slot.replayNext, header, payload)) {
+      if (slot.replayNext == ring.head - 1) {
+        return; // still being copied, try again later
+      }
+      slot.replayNext++;
+      continue;
+    }
+    slot.fromRing = true;
+    slot.ringId = slot.replayNext++;
+    slot.header = header;
+    slot.payload = payload;
+    slot.liveSequence = header->sequence + 1;
+    // Recorded frames are sent in full and may have another JPEG header
+    slot.jpegHeaderId = 0;
+    slot.offset = FRAME_START_OFFSET;
+    slot.lastProgress = now;
+    return;
+  }
+}
+
+// Starts writing the next backlog frame from the SD card spool, if one is
+// due. Sent in full, like replayed frames.
+static void nextBacklogFrame(FanoutServer &fanout, ClientSlot &slot, int64_t now) {
+  const FrameHeader *header;
+  const uint8_t *payload;
+  if (!spoolNext(*fanout.spool, header, payload, now)) {
+    return;
+  }
+  slot.fromSpool = true;
+  slot.header = header;
+  slot.payload = payload;
+  slot.jpegHeaderId = 0;
+  slot.offset = FRAME_START_OFFSET;
+  slot.lastProgress = now;
+}
+
+// Queues a message that is written to the client before its next frame.
+// Returns false if there is no room left for it.
+bool fanoutQueueMessage(ClientSlot &slot, uint8_t type, const void *payload, size_t length) {
+  if (slot.messageLength + sizeof(FrameHeader) + length > MESSAGE_BUFFER_SIZE) {
+    return false;
+  }
+  if (slot.messageLength == 0 && !slot.header) {
+    slot.lastProgress = esp_timer_get_time();
+  }
+  FrameHeader header = {};
+  header.magic = STREAM_MAGIC;
+  header.version = STREAM_VERSION;
+  header.type = type;
+  header.length = length;
+  header.timestamp = esp_timer_get_time();
+  memcpy(slot.message + slot.messageLength, &header, sizeof(header));
+  memcpy(slot.message + slot.messageLength + sizeof(header), payload, length);
+  slot.messageLength += sizeof(header) + length;
+  return true;
+}
+
+// Stamps the queued messages none of which has been written yet with the
+// time they are offered to the socket, so a pong tells when it left rather
+// than when it was queued behind a frame or other messages. The time the
+// ping was handled is in the pong itself.
+static void stampMessages(ClientSlot &slot) {
+  uint64_t timestamp = esp_timer_get_time();
+  size_t offset = 0;
+  while (offset < slot.messageLength) {
+    FrameHeader *header = (FrameHeader *)(slot.message + offset);
+    if (offset >= slot.messageOffset) {
+      header->timestamp = timestamp;
+    }
+    offset += sizeof(FrameHeader) + header->length;
+  }
+}
+
+// Writes `parts` with a single non-blocking call, which only takes what
+// fits in the lwIP send buffer. lwIP copies straight from the frame buffer
+// into its segments, there is no staging copy in between. Returns the
+// number of bytes the socket accepted, 0 if its send buffer is full and -1
+// on error.
+static ssize_t sendParts(ClientSlot &slot, struct iovec *parts, int count) {
+  struct msghdr message = {};
+  message.msg_iov = parts;
+  message.msg_iovlen = count;
+  size_t length = 0;
+  for (int i = 0; i < count; i++) {
+    length += parts[i].iov_len;
+  }
+
+  ssize_t written = sendmsg(slot.client.fd(), &message, MSG_DONTWAIT);
+  if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    written = 0;
+  }
+  if (written >= 0 && (size_t)written < length) {
+    statsCount(COUNTER_SHORT_WRITES);
+  }
+  return written;
+}
+
+static ssize_t sendSome(ClientSlot &slot, const uint8_t *data, size_t length) {
+  struct iovec part = { (void *)data, length };
+  return sendParts(slot, &part, 1);
+}
+
+// Accounts for a frame the client has written completely, `frame` is NULL
+// unless it was a live one.
+static void frameWritten(FanoutServer &fanout, ClientSlot &slot, const FrameHeader &header,
+                         const SharedFrame *frame, int64_t now) {
+  statsCount(COUNTER_FRAMES_SENT);
+#if FRAME_SENT_STAMPS
+  slot.stamps[slot.stampCount++] = { header.sequence, header.timestamp, (uint64_t)now };
+#endif
+  if (frame) {
+    statsTime(STAGE_SEND, now - frame->published);
+    statsTime(STAGE_TOTAL, now - (int64_t)header.timestamp);
+    if (fanout.frameSent) {
+      fanout.frameSent(*frame, now);
+    }
+  }
+}
+
+// Queues the stamps of the frames written so far, once the client is
+// between frames.
+static void queueStamps(ClientSlot &slot) {
+  for (int i = 0; i < slot.stampCount; i++) {
+    fanoutQueueMessage(slot, MESSAGE_FRAME_SENT, &slot.stamps[i], sizeof(FrameSentRecord));
+  }
+  slot.stampCount = 0;
+}
+
+// Writes the client's batch, headers and images, with a single send of at
+// most SEND_CHUNK_SIZE bytes. Frames written completely are done, one
+// written in part continues as the current frame. Returns what sendParts()
+// does.
+static ssize_t sendBatch(FanoutServer &fanout, ClientSlot &slot, int64_t now) {
+  struct iovec parts[2 * COALESCE_FRAMES];
+  int count = 0;
+  size_t length = 0;
+  for (int i = 0; i < slot.batchLength && length < SEND_CHUNK_SIZE; i++) {
+    const BatchedFrame &batched = slot.batch[i];
+#if FRAMED_STREAM
+    parts[count].iov_base = (void *)batched.header;
+    parts[count++].iov_len = sizeof(FrameHeader);
+    length += sizeof(FrameHeader);
+#endif
+    if (length < SEND_CHUNK_SIZE) {
+      parts[count].iov_base = (void *)batched.payload;
+      parts[count].iov_len = min((size_t)batched.header->length, SEND_CHUNK_SIZE - length);
+      length += parts[count++].iov_len;
+    }
+  }
+
+  ssize_t written = sendParts(slot, parts, count);
+  if (written <= 0) {
+    return written;
+  }
+  slot.lastProgress = now;
+  size_t remaining = written;
+  int done = 0;
+  while (done < slot.batchLength) {
+    BatchedFrame &batched = slot.batch[done];
+    size_t total = sizeof(FrameHeader) - FRAME_START_OFFSET + batched.header->length;
+    if (remaining < total) {
+      if (remaining > 0) {
+        slot.frame = batched.frame;
+        slot.header = batched.header;
+        slot.payload = batched.payload;
+        slot.offset = FRAME_START_OFFSET + remaining;
+        done++;
+      }
+      break;
+    }
+    remaining -= total;
+    frameWritten(fanout, slot, *batched.header, batched.frame, now);
+    releaseFrame(*batched.frame);
+    done++;
+  }
+  slot.batchLength -= done;
+  memmove(slot.batch, slot.batch + done, slot.batchLength * sizeof(BatchedFrame));
+  if (!slot.header) {
+    queueStamps(slot);
+  }
+  return written;
+}
+
+// Writes pending messages and the next piece of each client's current
+// frame, as far as the sockets accept them without blocking. Messages only
+// go out between frames. Returns true if any bytes were written.
+bool fanoutService(FanoutServer &fanout) {
+  bool progress = false;
+  int64_t now = esp_timer_get_time();
+  // Backlog goes to the first client only
+  bool backlogOffered = false;
+
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    ClientSlot &slot = fanout.slots[i];
+    if (!slot.active) {
+      continue;
+    }
+    bool error = false;
+    bool drainsBacklog = fanout.spool && !backlogOffered;
+    backlogOffered = true;
+
+    bool midFrame = slot.header && slot.offset > FRAME_START_OFFSET;
+    while (!midFrame && !error && slot.messageOffset < slot.messageLength) {
+      stampMessages(slot);
+      ssize_t written = sendSome(slot, slot.message + slot.messageOffset,
+                                 slot.messageLength - slot.messageOffset);
+      if (written == 0) {
+        break;
+      }
+      error = written < 0;
+      if (written > 0) {
+        slot.messageOffset += written;
+        slot.lastProgress = now;
+        progress = true;
+      }
+    }
+    if (slot.messageOffset == slot.messageLength) {
+      slot.messageLength = 0;
+      slot.messageOffset = 0;
+    }
+
+    if (!slot.header && slot.messageLength == 0 && batchDue(slot, now)) {
+      ssize_t written = sendBatch(fanout, slot, now);
+      error = written < 0;
+      progress = progress || written > 0;
+    }
+    if (!slot.header && slot.batchLength == 0 && slot.replaying) {
+      nextReplayFrame(fanout, slot, now);
+    }
+    if (!slot.header && slot.batchLength == 0 && drainsBacklog) {
+      nextBacklogFrame(fanout, slot, now);
+    }
+
+    // A frame that has started is finished first, messages queued in the
+    // meantime wait for it
+    if (!error && slot.header && (slot.offset > FRAME_START_OFFSET || slot.messageLength == 0)) {
+      const FrameHeader &header = *slot.header;
+      size_t total = sizeof(FrameHeader) + header.length;
+      // The header goes out together with the beginning of the image
+      struct iovec parts[2];
+      int count = 0;
+      if (slot.offset < sizeof(FrameHeader)) {
+        parts[count].iov_base = (uint8_t *)&header + slot.offset;
+        parts[count++].iov_len = sizeof(FrameHeader) - slot.offset;
+      }
+      size_t imageOffset = slot.offset > sizeof(FrameHeader) ? slot.offset - sizeof(FrameHeader) : 0;
+      parts[count].iov_base = (uint8_t *)slot.payload + imageOffset;
+      parts[count++].iov_len = min((size_t)SEND_CHUNK_SIZE, header.length - imageOffset);
+
+      ssize_t written = sendParts(slot, parts, count);
+      error = written < 0;
+      if (written > 0) {
+        slot.offset += written;
+        slot.lastProgress = now;
+        progress = true;
+      }
+      if (!error && slot.offset == total) {
+        frameWritten(fanout, slot, header, slot.frame, now);
+        if (slot.fromSpool) {
+          spoolSent(*fanout.spool, header);
+          slot.fromSpool = false;
+        }
+        finishFrame(fanout, slot);
+        queueStamps(slot);
+      }
+    }
+
+    if (error) {
+      Serial.printf("Error sending to client %d\n", i);
+      closeSlot(fanout, slot);
+    } else if ((slot.header || slot.batchLength > 0 || slot.messageLength > 0) &&
+               now - slot.lastProgress > SEND_TIMEOUT_MS * 1000LL) {
+      Serial.printf("Client %d stopped receiving\n", i);
+      closeSlot(fanout, slot);
+    }
+  }
+  return progress;
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include "esp_timer.h"
+#include "stream_stats.h"
+#include "task_load.h"
+
+// How often the achieved frame rate is printed (microseconds)
+#define PACER_REPORT_INTERVAL 5000000LL
+
+// Schedules captures on a fixed grid of absolute deadlines, so the time
+// spent capturing and sending is part of the frame period instead of being
+// added to it. When a deadline is missed by more than a whole period the
+// missed slots are skipped rather than sent in a burst.
+struct FramePacer {
+  int64_t period;   // microseconds between frames
+  int64_t deadline; // time of the next frame, 0 until the first one
+  float targetFps;
+  uint32_t frames;  // frames since the last report
+  uint32_t skipped; // missed slots since the last report
+  int64_t reportStart;
+};
+
+void pacerSetFps(FramePacer &pacer, float fps) {
+  pacer.targetFps = fps;
+  pacer.period = (int64_t)(1000000.0 / fps);
+}
+
+// Restarts the schedule, e.g. after streaming was paused.
+void pacerReset(FramePacer &pacer) {
+  pacer.deadline = 0;
+  pacer.frames = 0;
+  pacer.skipped = 0;
+}
+
+static void pacerAdvance(FramePacer &pacer, int64_t now) {
+  pacer.deadline += pacer.period;
+  if (now >= pacer.deadline) {
+    int64_t missed = (now - pacer.deadline) / pacer.period + 1;
+    pacer.deadline += missed * pacer.period;
+    pacer.skipped += missed;
+    statsCount(COUNTER_SKIPPED_SLOTS, missed);
+  }
+  pacer.frames++;
+
+  int64_t elapsed = now - pacer.reportStart;
+  if (elapsed >= PACER_REPORT_INTERVAL) {
+    Serial.printf("FPS: %.1f (target %.1f), %u skipped\n",
+                  pacer.frames * 1000000.0 / elapsed, pacer.targetFps, pacer.skipped);
+    pacer.frames = 0;
+    pacer.skipped = 0;
+    pacer.reportStart = now;
+  }
+}
+
+static void pacerStart(FramePacer &pacer, int64_t now) {
+  if (pacer.deadline == 0) {
+    pacer.deadline = now;
+    pacer.reportStart = now;
+  }
+}
+
+// Blocks until the next frame is due.
+void pacerWait(FramePacer &pacer) {
+  int64_t now = esp_timer_get_time();
+  pacerStart(pacer, now);
+
+  if (now < pacer.deadline) {
+    vTaskDelay(pdMS_TO_TICKS((pacer.deadline - now) / 1000));
+    int64_t woken = esp_timer_get_time();
+    loadWaited(LOAD_CAPTURE, woken - now);
+    now = woken;
+  }
+  pacerAdvance(pacer, now);
+}
+
+// Non-blocking variant of pacerWait(), returns true if a frame is due.
+bool pacerDue(FramePacer &pacer) {
+  int64_t now = esp_timer_get_time();
+  pacerStart(pacer, now);
+
+  if (now < pacer.deadline) {
+    return false;
+  }
+  pacerAdvance(pacer, now);
+  return true;
+}
+
+// Microseconds until the next frame is due, 0 if it is.
+int64_t pacerTimeToDue(const FramePacer &pacer) {
+  return max(pacer.deadline - esp_timer_get_time(), (int64_t)0);
+}
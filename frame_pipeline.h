@@ -0,0 +1,175 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "frame_stream.h"
+#include "frame_pacer.h"
+#include "camera_control.h"
+#include "multi_stream.h"
+#include "board_profile.h"
+#include "event_loop.h"
+
+// What the capture task does when the frame queue is full.
+#define QUEUE_DROP_OLDEST 0 // return the oldest queued frame to the driver
+#define QUEUE_BLOCK 1       // wait until the network task has taken a frame
+
+#if CONFIG_FREERTOS_UNICORE
+#undef CAPTURE_CORE
+#undef NETWORK_CORE
+#define CAPTURE_CORE 0
+#define NETWORK_CORE 0
+#endif
+
+// Queued frames and frames being sent on every stream each hold a frame
+// buffer. Boards without PSRAM only have one, capturing then waits for the
+// send.
+static_assert(!board.psram || PIPELINE_FRAME_BUFFERS <= cameraFbCount,
+              "FRAME_QUEUE_LENGTH + STREAM_COUNT * FRAMES_IN_FLIGHT exceeds FRAME_BUFFERS");
+static_assert(board.psram || FRAME_RING_SIZE == 0, "The frame ring needs PSRAM");
+static_assert(board.psram || !SD_SPOOL, "The SD card spool needs PSRAM");
+
+// Provided by the sketch: one round of non-blocking client I/O that returns
+// true if any data was written, sleeping until there is client I/O to do
+// or a frame was queued, whether anybody wants frames at all, whether a
+// captured frame is worth sending (after preparing it for sending), and
+// handing a frame to them.
+bool serviceClients();
+void waitForEvents(int timeoutMs);
+bool streamWanted();
+bool keepFrame(CapturedFrame &frame);
+void publishFrame(const CapturedFrame &frame);
+
+// Every queued frame holds one of the driver's `fb_count` buffers, and the
+// network task holds another one while sending. Keep FRAME_QUEUE_LENGTH
+// below fb_count or the capture task will stall in esp_camera_fb_get().
+static QueueHandle_t frameQueue;
+// Set by the network task, capturing is paused while nobody is connected.
+static volatile bool streamActive = false;
+
+static void enqueueFrame(const CapturedFrame &frame) {
+#if FRAME_QUEUE_POLICY == QUEUE_DROP_OLDEST
+  while (xQueueSend(frameQueue, &frame, 0) != pdTRUE) {
+    CapturedFrame oldest;
+    if (xQueueReceive(frameQueue, &oldest, 0) == pdTRUE) {
+      esp_camera_fb_return(oldest.fb);
+      statsCount(COUNTER_QUEUE_DROPS);
+    }
+  }
+#else
+  int64_t start = esp_timer_get_time();
+  xQueueSend(frameQueue, &frame, portMAX_DELAY);
+  loadWaited(LOAD_CAPTURE, esp_timer_get_time() - start);
+#endif
+  wakeupSignal();
+}
+
+// The capture task either paces a single stream or takes turns between
+// several (see multi_stream.h).
+#if MULTI_STREAM
+typedef MultiStream CaptureSchedule;
+#else
+typedef FramePacer CaptureSchedule;
+#endif
+
+static void scheduleReset(FramePacer &pacer) {
+  pacerReset(pacer);
+}
+
+static int scheduleNext(FramePacer &pacer) {
+  pacerWait(pacer);
+  applyPendingSettings(pacer);
+  return 0;
+}
+
+static bool scheduleCapture(FramePacer &, int, CapturedFrame &frame) {
+  return captureFrame(frame);
+}
+
+static void scheduleReset(MultiStream &streams) {
+  multiStreamReset(streams);
+}
+
+static int scheduleNext(MultiStream &streams) {
+  return multiStreamWait(streams);
+}
+
+static bool scheduleCapture(MultiStream &streams, int stream, CapturedFrame &frame) {
+  return multiStreamCapture(streams, stream, frame);
+}
+
+// Sleeps between attempts to capture, counted as idle for the governor.
+static void captureSleep(int milliseconds) {
+  int64_t start = esp_timer_get_time();
+  vTaskDelay(pdMS_TO_TICKS(milliseconds));
+  loadWaited(LOAD_CAPTURE, esp_timer_get_time() - start);
+}
+
+static void captureTask(void *parameter) {
+  CaptureSchedule &schedule = *(CaptureSchedule *)parameter;
+  for (;;) {
+    if (!streamActive) {
+      scheduleReset(schedule);
+      captureSleep(10);
+      continue;
+    }
+
+    int stream = scheduleNext(schedule);
+    if (stream < 0) {
+      captureSleep(10);
+      continue;
+    }
+
+    CapturedFrame frame;
+    if (!scheduleCapture(schedule, stream, frame)) {
+      Serial.println("Failed to capture image");
+      captureSleep(10);
+      continue;
+    }
+    if (!keepFrame(frame)) {
+      esp_camera_fb_return(frame.fb);
+      continue;
+    }
+    enqueueFrame(frame);
+  }
+}
+
+static void networkTask(void *) {
+  for (;;) {
+    bool progress = serviceClients();
+    streamActive = streamWanted();
+
+    CapturedFrame frame;
+    while (xQueueReceive(frameQueue, &frame, 0) == pdTRUE) {
+      if (streamActive) {
+        publishFrame(frame);
+        progress = true;
+      } else {
+        esp_camera_fb_return(frame.fb);
+      }
+    }
+
+    // Sockets that had room took what they could, wait for more room, a
+    // command, a connection or the next frame
+    if (!progress) {
+      waitForEvents(EVENT_WAIT_MS);
+    }
+  }
+}
+
+// Runs capture and network I/O as two tasks on separate cores, joined by a
+// queue of frame buffers, so a slow client doesn't lower the capture rate.
+bool startPipeline(CaptureSchedule &schedule) {
+  if (!wakeupBegin()) {
+    return false;
+  }
+  frameQueue = xQueueCreate(FRAME_QUEUE_LENGTH, sizeof(CapturedFrame));
+  if (!frameQueue) {
+    Serial.println("Failed to create frame queue");
+    return false;
+  }
+  if (xTaskCreatePinnedToCore(captureTask, "capture", 4096, &schedule, 5, NULL, CAPTURE_CORE) != pdPASS ||
+      xTaskCreatePinnedToCore(networkTask, "network", 8192, NULL, 4, NULL, NETWORK_CORE) != pdPASS) {
+    Serial.println("Failed to start pipeline tasks");
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,137 @@
+#pragma once
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
+#include "frame_stream.h"
+#include "memory_budget.h"
+
+// Most frames the ring keeps track of, regardless of their size
+#define RING_MAX_FRAMES 256
+
+struct RingEntry {
+  FrameHeader header;
+  uint32_t offset; // position of the image in the arena
+  uint8_t pins;    // clients currently writing this entry
+  bool valid;      // false while the image is still being copied
+};
+
+// The last frames copied out of the camera's frame buffers into one arena
+// in PSRAM that is allocated once. Frames are laid out one after another
+// and wrap around at the end; the oldest ones are evicted to make room.
+// Entries are identified by a counter that keeps increasing, `tail` is the
+// oldest entry still present and `head` the next one to be written.
+struct FrameRing {
+  uint8_t *arena;
+  size_t size;
+  size_t writeOffset;
+  RingEntry entries[RING_MAX_FRAMES];
+  uint32_t tail;
+  uint32_t head;
+  SemaphoreHandle_t lock;
+};
+
+// Allocates the arena, smaller than `size` if that doesn't fit in memory.
+// Less than a quarter of it isn't worth having.
+bool ringBegin(FrameRing &ring, size_t size) {
+  size_t available = memoryPsramAvailable();
+  if (available < size / 4) {
+    Serial.printf("Not enough memory for a %u byte frame ring\n", (unsigned)size);
+    ring.size = 0;
+    return false;
+  }
+  if (size > available) {
+    Serial.printf("Frame ring reduced to %u bytes to fit in memory\n", (unsigned)available);
+    size = available;
+  }
+  ring.arena = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  ring.lock = xSemaphoreCreateMutex();
+  if (!ring.arena || !ring.lock) {
+    Serial.printf("Failed to allocate a %u byte frame ring\n", (unsigned)size);
+    ring.size = 0;
+    return false;
+  }
+  ring.size = size;
+  memoryRecord("frame ring", 0, size);
+  return true;
+}
+
+static RingEntry &ringEntry(FrameRing &ring, uint32_t id) {
+  return ring.entries[id % RING_MAX_FRAMES];
+}
+
+// Copies `frame` into the ring. The frame isn't recorded if that would
+// evict an entry a client is still writing.
+bool ringRecord(FrameRing &ring, const CapturedFrame &frame) {
+  size_t length = frame.header.length;
+  if (length > ring.size) {
+    return false;
+  }
+
+  xSemaphoreTake(ring.lock, portMAX_DELAY);
+  bool wrap = ring.writeOffset + length > ring.size;
+  size_t start = wrap ? 0 : ring.writeOffset;
+  while (ring.tail != ring.head) {
+    RingEntry &oldest = ringEntry(ring, ring.tail);
+    bool skipped = wrap && oldest.offset >= ring.writeOffset;
+    bool overlaps = oldest.offset < start + length && oldest.offset + oldest.header.length > start;
+    if (!skipped && !overlaps && ring.head - ring.tail < RING_MAX_FRAMES) {
+      break;
+    }
+    if (oldest.pins > 0) {
+      xSemaphoreGive(ring.lock);
+      return false;
+    }
+    ring.tail++;
+  }
+
+  uint32_t id = ring.head++;
+  RingEntry &entry = ringEntry(ring, id);
+  entry.header = frame.header;
+  entry.offset = start;
+  entry.pins = 0;
+  entry.valid = false;
+  ring.writeOffset = start + length;
+  xSemaphoreGive(ring.lock);
+
+  // Entries being copied can't be pinned, so this doesn't need the lock
+  memcpy(ring.arena + start, frame.fb->buf, length);
+  xSemaphoreTake(ring.lock, portMAX_DELAY);
+  entry.valid = true;
+  xSemaphoreGive(ring.lock);
+  return true;
+}
+
+// First entry captured at or after `since` (microseconds), or `head` if
+// there is none.
+uint32_t ringFind(FrameRing &ring, int64_t since) {
+  xSemaphoreTake(ring.lock, portMAX_DELAY);
+  uint32_t id = ring.tail;
+  while (id != ring.head && (int64_t)ringEntry(ring, id).header.timestamp < since) {
+    id++;
+  }
+  xSemaphoreGive(ring.lock);
+  return id;
+}
+
+// Protects entry `id` from eviction until ringUnpin(). Returns false if it
+// was evicted already or is still being written.
+bool ringPin(FrameRing &ring, uint32_t id, const FrameHeader *&header, const uint8_t *&payload) {
+  xSemaphoreTake(ring.lock, portMAX_DELAY);
+  bool present = id - ring.tail < ring.head - ring.tail;
+  RingEntry &entry = ringEntry(ring, id);
+  bool pinned = present && entry.valid;
+  if (pinned) {
+    entry.pins++;
+    header = &entry.header;
+    payload = ring.arena + entry.offset;
+  }
+  xSemaphoreGive(ring.lock);
+  return pinned;
+}
+
+void ringUnpin(FrameRing &ring, uint32_t id) {
+  xSemaphoreTake(ring.lock, portMAX_DELAY);
+  ringEntry(ring, id).pins--;
+  xSemaphoreGive(ring.lock);
+}
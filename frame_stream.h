@@ -0,0 +1,59 @@
+#pragma once
+#include "esp_camera.h"
+#include "stream_protocol.h"
+#include "stream_stats.h"
+#include "task_load.h"
+
+// Capture time of a frame buffer in microseconds.
+static inline uint64_t frameTimestamp(const camera_fb_t *fb) {
+  return (uint64_t)fb->timestamp.tv_sec * 1000000ULL + fb->timestamp.tv_usec;
+}
+
+void fillFrameHeader(FrameHeader &header, const camera_fb_t *fb, uint32_t sequence) {
+  header.magic = STREAM_MAGIC;
+  header.version = STREAM_VERSION;
+  header.type = MESSAGE_FRAME;
+  header.format = fb->format;
+  header.length = fb->len;
+  header.sequence = sequence;
+  header.timestamp = frameTimestamp(fb);
+  header.width = fb->width;
+  header.height = fb->height;
+}
+
+// A frame taken from the driver together with the header it is sent with.
+struct CapturedFrame {
+  camera_fb_t *fb;
+  int64_t grabbed; // when esp_camera_fb_get() returned it
+  FrameHeader header;
+  uint8_t stream;  // stream the frame was captured for, see multi_stream.h
+};
+
+static uint32_t captureSequence = 0;
+
+// esp_camera_fb_get() with timing. Every captured frame gets the next
+// sequence number, so gaps tell receivers how many frames they missed.
+bool captureFrame(CapturedFrame &frame) {
+  int64_t start = esp_timer_get_time();
+  frame.fb = esp_camera_fb_get();
+  frame.grabbed = esp_timer_get_time();
+  loadWaited(LOAD_CAPTURE, frame.grabbed - start);
+  if (!frame.fb) {
+    statsCount(COUNTER_CAPTURE_ERRORS);
+    return false;
+  }
+  // fb->width and height hold the configured frame size, not the window
+  // set by camera_roi.h, so the header, UDP fragments and motion decoding
+  // would get the wrong size
+  uint16_t width, height;
+  if (frame.fb->format == PIXFORMAT_JPEG && jpegDimensions(frame.fb->buf, frame.fb->len, width, height)) {
+    frame.fb->width = width;
+    frame.fb->height = height;
+  }
+  fillFrameHeader(frame.header, frame.fb, captureSequence++);
+  frame.stream = 0;
+  statsTime(STAGE_GRAB, frame.grabbed - start);
+  statsTime(STAGE_BUFFER, frame.grabbed - (int64_t)frame.header.timestamp);
+  statsCount(COUNTER_FRAMES_CAPTURED);
+  return true;
+}
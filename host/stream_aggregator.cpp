@@ -0,0 +1,506 @@
+// Holds a single connection to each camera and serves its stream to any
+// number of consumers, so every camera carries the load of one client no
+// matter how many there are. Needs firmware built with FRAMED_STREAM.
+//
+//   g++ -std=c++17 -O2 -pthread -o stream_aggregator host/stream_aggregator.cpp
+//   ./stream_aggregator [--port 8000] [--threads n] [--buffer-kb 512] <camera>[:port] ...
+//
+// The n-th camera is served on port 8000 + n as a framed stream of
+// MESSAGE_FRAME messages. Compact frames are rebuilt into whole ones, so a
+// consumer can start with any frame. Replies, statistics and the other
+// messages are meant for the aggregator and aren't passed on, commands
+// from consumers are ignored.
+//
+// The cameras are spread over the worker threads, each one serving its
+// cameras and their consumers with poll(). A frame is received once into a
+// buffer of the worker's pool and written to every consumer from there.
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../stream_protocol.h"
+
+// Frames waiting to be written to a consumer. A consumer that falls further
+// behind skips frames, like a slow client of the camera does.
+#define CONSUMER_QUEUE_LENGTH 4
+// Buffers a camera's frames may take, allocated as they are needed. Frames
+// are only dropped for every consumer once consumers at different points of
+// the stream hold all of them.
+#define BUFFERS_PER_CAMERA 16
+#define RECONNECT_MS 1000
+// Leading bytes of a dropped full frame read to keep its JPEG header. The
+// camera only sends compact frames for headers up to its JPEG_HEADER_MAX.
+#define JPEG_HEADER_SCAN 1024
+#define STATS_INTERVAL_MS 10000
+
+static int64_t nowMicros() {
+  using namespace std::chrono;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void setNonBlocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+static bool wouldBlock() {
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+// A frame as consumers receive it, header included. Shared by every
+// consumer writing it and back in the pool once the last one is done.
+struct Buffer {
+  std::vector<uint8_t> data;
+  size_t length;
+  int refs;
+};
+
+// Buffers of one worker, only ever touched by its thread. They are
+// allocated as they are first needed, up to `limit`.
+struct BufferPool {
+  std::vector<std::unique_ptr<Buffer>> buffers;
+  std::vector<Buffer *> free;
+  size_t capacity; // bytes of every buffer
+  size_t limit;
+};
+
+// A free buffer holding one reference, NULL if they are all in use.
+static Buffer *poolTake(BufferPool &pool) {
+  if (pool.free.empty()) {
+    if (pool.buffers.size() == pool.limit) {
+      return nullptr;
+    }
+    pool.buffers.emplace_back(new Buffer());
+    pool.buffers.back()->data.resize(pool.capacity);
+    pool.free.push_back(pool.buffers.back().get());
+  }
+  Buffer *buffer = pool.free.back();
+  pool.free.pop_back();
+  buffer->length = 0;
+  buffer->refs = 1;
+  return buffer;
+}
+
+static void bufferRelease(BufferPool &pool, Buffer *buffer) {
+  if (--buffer->refs == 0) {
+    pool.free.push_back(buffer);
+  }
+}
+
+struct Consumer {
+  int fd; // -1 once it is gone
+  // Frames to write, the first one from `offset`
+  std::deque<Buffer *> queue;
+  size_t offset;
+};
+
+struct Camera {
+  std::string host;
+  std::string port;
+  int listener;
+  uint16_t servePort;
+  int fd; // -1 while disconnected
+  bool connecting;
+  int64_t retryAt;
+  // Message being received. Frames go straight into `buffer`, their payload
+  // at `payloadOffset`; other messages are read and dropped.
+  FrameHeader header;
+  size_t headerReceived;
+  size_t payloadReceived;
+  Buffer *buffer;
+  size_t payloadOffset;
+  // JPEG header of the last full frame, to rebuild compact frames with
+  std::vector<uint8_t> jpegHeader;
+  // Bytes of a dropped full frame to read into `jpegHeader`, 0 otherwise
+  size_t headerScan;
+  std::vector<Consumer> consumers;
+  // Since the last statistics
+  uint32_t frames;
+  uint32_t dropped; // frames not received into a buffer
+  uint32_t skipped; // frames consumers skipped
+  uint64_t bytes;
+};
+
+struct Worker {
+  std::vector<Camera *> cameras;
+  BufferPool pool;
+};
+
+static void closeConsumer(BufferPool &pool, Consumer &consumer) {
+  for (Buffer *buffer : consumer.queue) {
+    bufferRelease(pool, buffer);
+  }
+  consumer.queue.clear();
+  close(consumer.fd);
+  consumer.fd = -1;
+}
+
+static void disconnectCamera(Worker &worker, Camera &camera, const char *reason) {
+  fprintf(stderr, "%s:%s: %s\n", camera.host.c_str(), camera.port.c_str(), reason);
+  close(camera.fd);
+  camera.fd = -1;
+  camera.connecting = false;
+  camera.retryAt = nowMicros() + RECONNECT_MS * 1000LL;
+  if (camera.buffer) {
+    bufferRelease(worker.pool, camera.buffer);
+    camera.buffer = nullptr;
+  }
+  camera.headerReceived = 0;
+  camera.payloadReceived = 0;
+  camera.jpegHeader.clear();
+  camera.headerScan = 0;
+}
+
+// Starts a non-blocking connect, finished once the socket is writable.
+static void connectCamera(Camera &camera) {
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *addresses;
+  camera.retryAt = nowMicros() + RECONNECT_MS * 1000LL;
+  int error = getaddrinfo(camera.host.c_str(), camera.port.c_str(), &hints, &addresses);
+  if (error != 0) {
+    fprintf(stderr, "%s: %s\n", camera.host.c_str(), gai_strerror(error));
+    return;
+  }
+  int fd = socket(addresses->ai_family, addresses->ai_socktype, addresses->ai_protocol);
+  if (fd >= 0) {
+    setNonBlocking(fd);
+    if (connect(fd, addresses->ai_addr, addresses->ai_addrlen) == 0 || errno == EINPROGRESS) {
+      camera.fd = fd;
+      camera.connecting = true;
+    } else {
+      close(fd);
+    }
+  }
+  freeaddrinfo(addresses);
+}
+
+// Called once the header of a message is in: finds a buffer for a frame.
+static void startMessage(Worker &worker, Camera &camera) {
+  const FrameHeader &header = camera.header;
+  bool compact = header.type == MESSAGE_COMPACT_FRAME;
+  if (header.type != MESSAGE_FRAME && !compact) {
+    return;
+  }
+  // Compact frames can't be rebuilt without the headers of the last full
+  // frame, so they are dropped until one was received
+  if (compact && camera.jpegHeader.empty()) {
+    camera.dropped++;
+    return;
+  }
+  size_t offset = sizeof(FrameHeader) + (compact ? camera.jpegHeader.size() : 0);
+  if (offset + header.length <= worker.pool.capacity) {
+    camera.buffer = poolTake(worker.pool);
+  }
+  if (!camera.buffer) {
+    // The camera only sends a full frame again once its JPEG header
+    // changes, so the header is still taken from this one
+    if (!compact) {
+      camera.jpegHeader.resize(std::min<size_t>(header.length, JPEG_HEADER_SCAN));
+      camera.headerScan = camera.jpegHeader.size();
+    }
+    camera.dropped++;
+    return;
+  }
+  camera.payloadOffset = offset;
+  if (compact) {
+    memcpy(camera.buffer->data.data() + sizeof(FrameHeader), camera.jpegHeader.data(), camera.jpegHeader.size());
+  }
+}
+
+// Called once the whole message is in: hands a frame to every consumer.
+static void finishMessage(Worker &worker, Camera &camera) {
+  if (camera.headerScan) {
+    camera.jpegHeader.resize(jpegHeaderLength(camera.jpegHeader.data(), camera.jpegHeader.size()));
+    camera.headerScan = 0;
+  }
+  Buffer *buffer = camera.buffer;
+  if (!buffer) {
+    return;
+  }
+  camera.buffer = nullptr;
+  uint8_t *image = buffer->data.data() + sizeof(FrameHeader);
+  FrameHeader header = camera.header;
+  header.type = MESSAGE_FRAME;
+  header.length += camera.payloadOffset - sizeof(FrameHeader);
+  memcpy(buffer->data.data(), &header, sizeof(header));
+  buffer->length = sizeof(header) + header.length;
+  if (camera.header.type == MESSAGE_FRAME) {
+    camera.jpegHeader.assign(image, image + jpegHeaderLength(image, header.length));
+  }
+
+  camera.frames++;
+  camera.bytes += buffer->length;
+  for (Consumer &consumer : camera.consumers) {
+    if (consumer.queue.size() < CONSUMER_QUEUE_LENGTH) {
+      buffer->refs++;
+      consumer.queue.push_back(buffer);
+    } else {
+      camera.skipped++;
+    }
+  }
+  bufferRelease(worker.pool, buffer);
+}
+
+// Reads what the camera has sent. Returns false if the connection is lost
+// or the stream is broken.
+static bool receiveCamera(Worker &worker, Camera &camera) {
+  uint8_t discard[16384];
+  for (;;) {
+    ssize_t n;
+    if (camera.headerReceived < sizeof(FrameHeader)) {
+      n = recv(camera.fd, (uint8_t *)&camera.header + camera.headerReceived,
+               sizeof(FrameHeader) - camera.headerReceived, MSG_DONTWAIT);
+      if (n > 0 && (camera.headerReceived += n) == sizeof(FrameHeader)) {
+        if (camera.header.magic != STREAM_MAGIC) {
+          return false;
+        }
+        startMessage(worker, camera);
+      }
+    } else if (camera.payloadReceived < camera.header.length) {
+      size_t remaining = camera.header.length - camera.payloadReceived;
+      if (camera.buffer) {
+        n = recv(camera.fd, camera.buffer->data.data() + camera.payloadOffset + camera.payloadReceived, remaining,
+                 MSG_DONTWAIT);
+      } else if (camera.payloadReceived < camera.headerScan) {
+        n = recv(camera.fd, camera.jpegHeader.data() + camera.payloadReceived,
+                 camera.headerScan - camera.payloadReceived, MSG_DONTWAIT);
+      } else {
+        n = recv(camera.fd, discard, std::min(remaining, sizeof(discard)), MSG_DONTWAIT);
+      }
+      if (n > 0) {
+        camera.payloadReceived += n;
+      }
+    } else {
+      finishMessage(worker, camera);
+      camera.headerReceived = 0;
+      camera.payloadReceived = 0;
+      continue;
+    }
+    if (n == 0) {
+      return false;
+    }
+    if (n < 0) {
+      return wouldBlock();
+    }
+  }
+}
+
+// Writes as much of the consumer's queue as its socket takes.
+static bool sendConsumer(BufferPool &pool, Consumer &consumer) {
+  while (!consumer.queue.empty()) {
+    Buffer *buffer = consumer.queue.front();
+    ssize_t n = send(consumer.fd, buffer->data.data() + consumer.offset, buffer->length - consumer.offset,
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      return wouldBlock();
+    }
+    consumer.offset += n;
+    if (consumer.offset < buffer->length) {
+      return true;
+    }
+    consumer.offset = 0;
+    consumer.queue.pop_front();
+    bufferRelease(pool, buffer);
+  }
+  return true;
+}
+
+// Reads and ignores what the consumer sends. Returns false once it is gone.
+static bool receiveConsumer(Consumer &consumer) {
+  uint8_t discard[1024];
+  ssize_t n;
+  while ((n = recv(consumer.fd, discard, sizeof(discard), MSG_DONTWAIT)) > 0) {
+  }
+  return n < 0 && wouldBlock();
+}
+
+static void acceptConsumers(Camera &camera) {
+  int fd;
+  while ((fd = accept(camera.listener, nullptr, nullptr)) >= 0) {
+    setNonBlocking(fd);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    camera.consumers.push_back({ fd, {}, 0 });
+  }
+}
+
+static void printStats(Worker &worker, double seconds) {
+  for (Camera *camera : worker.cameras) {
+    printf("%s:%s -> %u: %s, %.1f fps, %.1f kB/s, %zu consumers, %u frames dropped, %u skipped by consumers\n",
+           camera->host.c_str(), camera->port.c_str(), camera->servePort,
+           camera->fd < 0 || camera->connecting ? "disconnected" : "connected", camera->frames / seconds,
+           camera->bytes / 1024.0 / seconds, camera->consumers.size(), camera->dropped, camera->skipped);
+    camera->frames = 0;
+    camera->dropped = 0;
+    camera->skipped = 0;
+    camera->bytes = 0;
+  }
+  fflush(stdout);
+}
+
+// What a polled socket belongs to
+struct Watched {
+  Camera *camera;
+  int consumer; // index into camera->consumers, -1 for the camera, -2 for its listener
+};
+
+static void runWorker(Worker &worker) {
+  std::vector<pollfd> fds;
+  std::vector<Watched> watched;
+  int64_t lastStats = nowMicros();
+  for (;;) {
+    int64_t now = nowMicros();
+    fds.clear();
+    watched.clear();
+    for (Camera *camera : worker.cameras) {
+      if (camera->fd < 0 && now >= camera->retryAt) {
+        connectCamera(*camera);
+      }
+      fds.push_back({ camera->listener, POLLIN, 0 });
+      watched.push_back({ camera, -2 });
+      if (camera->fd >= 0) {
+        fds.push_back({ camera->fd, (short)(camera->connecting ? POLLOUT : POLLIN), 0 });
+        watched.push_back({ camera, -1 });
+      }
+      for (size_t i = 0; i < camera->consumers.size(); i++) {
+        const Consumer &consumer = camera->consumers[i];
+        fds.push_back({ consumer.fd, (short)(POLLIN | (consumer.queue.empty() ? 0 : POLLOUT)), 0 });
+        watched.push_back({ camera, (int)i });
+      }
+    }
+    poll(fds.data(), fds.size(), RECONNECT_MS);
+
+    for (size_t i = 0; i < fds.size(); i++) {
+      Camera &camera = *watched[i].camera;
+      int index = watched[i].consumer;
+      if (fds[i].revents == 0) {
+        continue;
+      }
+      if (index == -2) {
+        acceptConsumers(camera);
+      } else if (index == -1 && camera.connecting) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(camera.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0) {
+          disconnectCamera(worker, camera, strerror(error));
+        } else {
+          camera.connecting = false;
+          fprintf(stderr, "%s:%s: connected\n", camera.host.c_str(), camera.port.c_str());
+        }
+      } else if (index == -1) {
+        if (!receiveCamera(worker, camera)) {
+          disconnectCamera(worker, camera, "connection lost");
+        }
+      } else if (!receiveConsumer(camera.consumers[index])) {
+        closeConsumer(worker.pool, camera.consumers[index]);
+      }
+    }
+    // Frames received in this round are written right away, a consumer
+    // whose socket is full is simply left where it was
+    for (Camera *camera : worker.cameras) {
+      for (Consumer &consumer : camera->consumers) {
+        if (consumer.fd >= 0 && !sendConsumer(worker.pool, consumer)) {
+          closeConsumer(worker.pool, consumer);
+        }
+      }
+      camera->consumers.erase(std::remove_if(camera->consumers.begin(), camera->consumers.end(),
+                                             [](const Consumer &c) { return c.fd < 0; }),
+                              camera->consumers.end());
+    }
+
+    now = nowMicros();
+    if (now - lastStats >= STATS_INTERVAL_MS * 1000LL) {
+      printStats(worker, (now - lastStats) / 1e6);
+      lastStats = now;
+    }
+  }
+}
+
+static int listenOn(uint16_t port) {
+  int fd = socket(AF_INET6, SOCK_STREAM, 0);
+  int one = 1, zero = 0;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+  sockaddr_in6 address = {};
+  address.sin6_family = AF_INET6;
+  address.sin6_port = htons(port);
+  address.sin6_addr = in6addr_any;
+  if (fd < 0 || bind(fd, (sockaddr *)&address, sizeof(address)) < 0 || listen(fd, 16) < 0) {
+    perror("listen");
+    return -1;
+  }
+  setNonBlocking(fd);
+  return fd;
+}
+
+int main(int argc, char **argv) {
+  int basePort = 8000;
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  size_t bufferKb = 512;
+  std::vector<std::unique_ptr<Camera>> cameras;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+      basePort = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads = std::max(1, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--buffer-kb") == 0 && i + 1 < argc) {
+      bufferKb = std::max(1, atoi(argv[++i]));
+    } else {
+      std::string address = argv[i];
+      size_t colon = address.rfind(':');
+      Camera *camera = new Camera();
+      camera->host = colon == std::string::npos ? address : address.substr(0, colon);
+      camera->port = colon == std::string::npos ? "1234" : address.substr(colon + 1);
+      camera->fd = -1;
+      cameras.emplace_back(camera);
+    }
+  }
+  if (cameras.empty()) {
+    fprintf(stderr, "usage: %s [--port 8000] [--threads n] [--buffer-kb 512] <camera>[:port] ...\n", argv[0]);
+    return 2;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  threads = std::min(threads, (int)cameras.size());
+  std::vector<Worker> workers(threads);
+  for (size_t i = 0; i < cameras.size(); i++) {
+    Camera &camera = *cameras[i];
+    camera.servePort = basePort + i;
+    camera.listener = listenOn(camera.servePort);
+    if (camera.listener < 0) {
+      return 1;
+    }
+    printf("%s:%s on port %u\n", camera.host.c_str(), camera.port.c_str(), camera.servePort);
+    Worker &worker = workers[i % threads];
+    worker.cameras.push_back(&camera);
+    worker.pool.capacity = bufferKb * 1024;
+    worker.pool.limit += BUFFERS_PER_CAMERA;
+  }
+  fflush(stdout);
+
+  std::vector<std::thread> running;
+  for (Worker &worker : workers) {
+    running.emplace_back(runWorker, std::ref(worker));
+  }
+  for (std::thread &thread : running) {
+    thread.join();
+  }
+  return 0;
+}
@@ -0,0 +1,426 @@
+// Connects to the camera's TCP stream and reports what it delivers: frame
+// rate, throughput, frame sizes, jitter and latency, and checks that every
+// message is well formed.
+//
+//   g++ -std=c++17 -O2 -o stream_bench host/stream_bench.cpp
+//   ./stream_bench <address> [port] [seconds] [--raw]
+//
+// Use --raw for firmware built with FRAMED_STREAM 0, frames are then found
+// by their JPEG markers and there are no sequence numbers or timestamps.
+// Compact frames (COMPACT_JPEG) are rebuilt into whole images before they
+// are checked. On a framed stream the camera is pinged once a second to
+// map its clock to ours, so latency is also given from capture to arrival.
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../stream_protocol.h"
+
+static int64_t nowMicros() {
+  using namespace std::chrono;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static int connectTo(const char *host, const char *port) {
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *addresses;
+  int error = getaddrinfo(host, port, &hints, &addresses);
+  if (error != 0) {
+    fprintf(stderr, "%s: %s\n", host, gai_strerror(error));
+    return -1;
+  }
+  int fd = -1;
+  for (addrinfo *a = addresses; a; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+      break;
+    }
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  if (fd < 0) {
+    perror("connect");
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  timeval timeout = { 5, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return fd;
+}
+
+static bool readExactly(int fd, void *buffer, size_t length) {
+  uint8_t *p = (uint8_t *)buffer;
+  while (length > 0) {
+    ssize_t n = recv(fd, p, length, 0);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+// Offset between the camera's clock and ours, from the ping with the
+// shortest round trip.
+struct ClockSync {
+  int64_t offset;    // camera clock minus ours
+  int64_t roundTrip; // INT64_MAX until a pong arrived
+};
+
+struct Frame {
+  int64_t received;  // host time the last byte arrived
+  uint64_t timestamp; // capture time on the camera, 0 on a raw stream
+  uint32_t sequence;
+  size_t length;      // bytes of the image
+  size_t wire;        // bytes received for it
+};
+
+struct Conformance {
+  uint32_t badMagic;
+  uint32_t badVersion;
+  uint32_t unknownTypes;
+  uint32_t badJpeg;       // payload doesn't start with SOI or end with EOI
+  uint32_t sequenceGaps;  // frames missing according to the sequence numbers
+  uint32_t reordered;     // sequence or timestamp going backwards
+  uint32_t messages;      // replies, statistics, backlog frames and stamps
+  uint32_t noJpegHeader;  // compact frames before any full frame
+  uint32_t badSize;       // uncompressed frames of the wrong length
+};
+
+// Values of FrameHeader::format (pixformat_t)
+enum : uint16_t {
+  PIXFORMAT_RGB565 = 0,
+  PIXFORMAT_YUV422 = 1,
+  PIXFORMAT_GRAYSCALE = 3,
+  PIXFORMAT_JPEG = 4,
+};
+
+static size_t bytesPerPixel(uint16_t format) {
+  return format == PIXFORMAT_RGB565 || format == PIXFORMAT_YUV422 ? 2 : 1;
+}
+
+static bool isJpeg(const std::vector<uint8_t> &data) {
+  size_t n = data.size();
+  // The driver may pad frames after EOI, so look at the last few bytes
+  if (n < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+    return false;
+  }
+  for (size_t i = n - 2; i + 32 >= n && i > 1; i--) {
+    if (data[i] == 0xFF && data[i + 1] == 0xD9) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Reads one message of the framed stream. Returns false when the stream
+// ends or can't be resynchronized.
+static bool readFramed(int fd, std::vector<uint8_t> &payload, FrameHeader &header, Conformance &c) {
+  if (!readExactly(fd, &header, sizeof(header))) {
+    return false;
+  }
+  if (header.magic != STREAM_MAGIC) {
+    c.badMagic++;
+    return false;
+  }
+  if (header.version != STREAM_VERSION) {
+    c.badVersion++;
+  }
+  payload.resize(header.length);
+  return readExactly(fd, payload.data(), payload.size());
+}
+
+// Reads one image of the raw stream by scanning for its JPEG markers.
+static bool readRaw(int fd, std::vector<uint8_t> &pending, std::vector<uint8_t> &image) {
+  uint8_t buffer[16384];
+  for (;;) {
+    size_t start = std::string::npos;
+    for (size_t i = 0; i + 1 < pending.size(); i++) {
+      if (start == std::string::npos && pending[i] == 0xFF && pending[i + 1] == 0xD8) {
+        start = i;
+      } else if (start != std::string::npos && pending[i] == 0xFF && pending[i + 1] == 0xD9) {
+        image.assign(pending.begin() + start, pending.begin() + i + 2);
+        pending.erase(pending.begin(), pending.begin() + i + 2);
+        return true;
+      }
+    }
+    ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+    if (n <= 0) {
+      return false;
+    }
+    pending.insert(pending.end(), buffer, buffer + n);
+  }
+}
+
+static double percentile(std::vector<double> values, double p) {
+  if (values.empty()) {
+    return 0;
+  }
+  std::sort(values.begin(), values.end());
+  size_t index = std::min(values.size() - 1, (size_t)(p / 100.0 * values.size()));
+  return values[index];
+}
+
+static double stddev(const std::vector<double> &values) {
+  if (values.size() < 2) {
+    return 0;
+  }
+  double mean = 0;
+  for (double v : values) {
+    mean += v;
+  }
+  mean /= values.size();
+  double sum = 0;
+  for (double v : values) {
+    sum += (v - mean) * (v - mean);
+  }
+  return std::sqrt(sum / (values.size() - 1));
+}
+
+static void printDistribution(const char *name, const char *unit, const std::vector<double> &values) {
+  if (values.empty()) {
+    return;
+  }
+  printf("%-22s p50 %8.1f  p95 %8.1f  p99 %8.1f  max %8.1f %s\n", name, percentile(values, 50),
+         percentile(values, 95), percentile(values, 99), *std::max_element(values.begin(), values.end()), unit);
+}
+
+static bool sendPing(int fd) {
+  uint8_t command[sizeof(ControlHeader) + sizeof(uint64_t)];
+  ControlHeader header = { CONTROL_PING, sizeof(uint64_t) };
+  uint64_t now = nowMicros();
+  memcpy(command, &header, sizeof(header));
+  memcpy(command + sizeof(header), &now, sizeof(now));
+  return send(fd, command, sizeof(command), 0) == (ssize_t)sizeof(command);
+}
+
+// Asks for a StatsRecord, which tells the firmware variant.
+static bool requestStats(int fd) {
+  ControlHeader header = { CONTROL_GET_STATS, 0 };
+  return send(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+}
+
+static void onPong(ClockSync &sync, const FrameHeader &header, const std::vector<uint8_t> &payload) {
+  int64_t arrived = nowMicros();
+  PongRecord pong;
+  if (payload.size() < sizeof(pong)) {
+    return;
+  }
+  memcpy(&pong, payload.data(), sizeof(pong));
+  int64_t roundTrip = (arrived - (int64_t)pong.clientTime) - ((int64_t)header.timestamp - (int64_t)pong.received);
+  if (roundTrip < sync.roundTrip) {
+    sync.roundTrip = roundTrip;
+    sync.offset = (((int64_t)pong.received - (int64_t)pong.clientTime) + ((int64_t)header.timestamp - arrived)) / 2;
+  }
+}
+
+static void report(const std::vector<Frame> &frames, int64_t start, int64_t end, bool framed, const Conformance &c,
+                   const ClockSync &sync, const std::vector<double> &written, const std::string &variant) {
+  double seconds = (end - start) / 1e6;
+  size_t bytes = 0, image = 0;
+  std::vector<double> sizes, arrival, capture, latency, synced;
+  for (size_t i = 0; i < frames.size(); i++) {
+    bytes += frames[i].wire;
+    image += frames[i].length;
+    sizes.push_back(frames[i].length / 1024.0);
+    if (i > 0) {
+      arrival.push_back((frames[i].received - frames[i - 1].received) / 1000.0);
+      if (framed) {
+        capture.push_back(((int64_t)frames[i].timestamp - (int64_t)frames[i - 1].timestamp) / 1000.0);
+      }
+    }
+  }
+  // The camera's clock isn't synchronized with ours, so latency is given
+  // relative to the fastest frame: the offset between the clocks plus the
+  // smallest delay cancels out, what remains is the delay added on top.
+  if (framed && !frames.empty()) {
+    int64_t offset = INT64_MAX;
+    for (const Frame &f : frames) {
+      offset = std::min(offset, f.received - (int64_t)f.timestamp);
+    }
+    for (const Frame &f : frames) {
+      latency.push_back((f.received - (int64_t)f.timestamp - offset) / 1000.0);
+      if (sync.roundTrip != INT64_MAX) {
+        synced.push_back((f.received - ((int64_t)f.timestamp - sync.offset)) / 1000.0);
+      }
+    }
+  }
+
+  printf("\n%zu frames in %.1f s: %.2f fps, %.1f kB/s\n", frames.size(), seconds, frames.size() / seconds,
+         bytes / 1024.0 / seconds);
+  if (!variant.empty()) {
+    printf("firmware variant %s\n", variant.c_str());
+  }
+  if (image > bytes) {
+    printf("compact frames saved %.1f%% of %.1f kB\n", 100.0 * (image - bytes) / image, image / 1024.0);
+  }
+  printDistribution("frame size", "kB", sizes);
+  printDistribution("inter-arrival", "ms", arrival);
+  printf("%-22s %.2f ms\n", "arrival jitter (sd)", stddev(arrival));
+  if (framed) {
+    printDistribution("capture interval", "ms", capture);
+    printf("%-22s %.2f ms\n", "capture jitter (sd)", stddev(capture));
+    printDistribution("latency above min", "ms", latency);
+    if (sync.roundTrip != INT64_MAX) {
+      printDistribution("capture to arrival", "ms", synced);
+      printf("%-22s +-%.1f ms\n", "clock sync", sync.roundTrip / 2000.0);
+    }
+    printDistribution("capture to written", "ms", written);
+    printf("\nconformance: %u bad magic, %u bad version, %u unknown types, %u bad JPEG, "
+           "%u frames missing, %u reordered, %u other messages, %u compact frames without a header, "
+           "%u uncompressed frames of the wrong size\n",
+           c.badMagic, c.badVersion, c.unknownTypes, c.badJpeg, c.sequenceGaps, c.reordered, c.messages,
+           c.noJpegHeader, c.badSize);
+  } else {
+    printf("\nconformance: %u bad JPEG\n", c.badJpeg);
+  }
+}
+
+int main(int argc, char **argv) {
+  std::vector<const char *> args;
+  bool raw = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--raw") == 0) {
+      raw = true;
+    } else {
+      args.push_back(argv[i]);
+    }
+  }
+  if (args.empty()) {
+    fprintf(stderr, "usage: %s <address> [port] [seconds] [--raw]\n", argv[0]);
+    return 2;
+  }
+  const char *port = args.size() > 1 ? args[1] : "1234";
+  double duration = args.size() > 2 ? atof(args[2]) : 10;
+
+  int fd = connectTo(args[0], port);
+  if (fd < 0) {
+    return 1;
+  }
+  if (!raw) {
+    requestStats(fd);
+  }
+
+  std::vector<Frame> frames;
+  std::vector<uint8_t> payload, pending, jpegHeader;
+  uint16_t format = PIXFORMAT_JPEG, width = 0, height = 0;
+  Conformance c = {};
+  ClockSync sync = { 0, INT64_MAX };
+  std::vector<double> written;
+  std::string variant;
+  int64_t lastPing = 0;
+  int64_t start = nowMicros();
+  int64_t second = start;
+  size_t secondFrames = 0, secondBytes = 0;
+  bool ok = true;
+  while (nowMicros() - start < duration * 1e6) {
+    Frame frame = {};
+    if (raw) {
+      ok = readRaw(fd, pending, payload);
+    } else {
+      if (nowMicros() - lastPing >= 1000000) {
+        lastPing = nowMicros();
+        sendPing(fd);
+      }
+      FrameHeader header;
+      ok = readFramed(fd, payload, header, c);
+      frame.wire = payload.size();
+      if (ok && header.type == MESSAGE_FRAME) {
+        uint32_t length = jpegHeaderLength(payload.data(), payload.size());
+        jpegHeader.assign(payload.begin(), payload.begin() + length);
+      } else if (ok && header.type == MESSAGE_COMPACT_FRAME) {
+        if (jpegHeader.empty()) {
+          c.noJpegHeader++;
+          continue;
+        }
+        payload.insert(payload.begin(), jpegHeader.begin(), jpegHeader.end());
+      } else if (ok) {
+        if (header.type == MESSAGE_PONG) {
+          onPong(sync, header, payload);
+        } else if (header.type == MESSAGE_FRAME_SENT && payload.size() >= sizeof(FrameSentRecord)) {
+          FrameSentRecord sent;
+          memcpy(&sent, payload.data(), sizeof(sent));
+          written.push_back(((int64_t)sent.written - (int64_t)sent.timestamp) / 1000.0);
+        } else if (header.type == MESSAGE_STATS && payload.size() >= sizeof(StatsRecord)) {
+          StatsRecord stats;
+          memcpy(&stats, payload.data(), sizeof(stats));
+          variant.assign(stats.variant, strnlen(stats.variant, sizeof(stats.variant)));
+        }
+        if (header.type == MESSAGE_PONG || header.type == MESSAGE_FRAME_SENT ||
+            header.type == MESSAGE_CONTROL_REPLY || header.type == MESSAGE_STATS ||
+            header.type == MESSAGE_BACKLOG_FRAME) {
+          c.messages++;
+        } else {
+          c.unknownTypes++;
+        }
+        continue;
+      }
+      frame.sequence = header.sequence;
+      frame.timestamp = header.timestamp;
+      format = header.format;
+      width = header.width;
+      height = header.height;
+    }
+    if (!ok) {
+      break;
+    }
+    frame.received = nowMicros();
+    frame.length = payload.size();
+    if (raw) {
+      frame.wire = frame.length;
+    }
+    if (!raw && format != PIXFORMAT_JPEG) {
+      // Uncompressed images, e.g. TENSOR_STREAM, have a size of their own
+      if (frame.length != (size_t)width * height * bytesPerPixel(format)) {
+        c.badSize++;
+      }
+    } else if (!isJpeg(payload)) {
+      c.badJpeg++;
+    }
+    if (!raw && !frames.empty()) {
+      const Frame &last = frames.back();
+      if (frame.sequence <= last.sequence || frame.timestamp <= last.timestamp) {
+        c.reordered++;
+      } else {
+        c.sequenceGaps += frame.sequence - last.sequence - 1;
+      }
+    }
+    frames.push_back(frame);
+
+    secondFrames++;
+    secondBytes += frame.wire;
+    if (frame.received - second >= 1000000) {
+      double elapsed = (frame.received - second) / 1e6;
+      printf("%5.1f fps %8.1f kB/s\n", secondFrames / elapsed, secondBytes / 1024.0 / elapsed);
+      fflush(stdout);
+      second = frame.received;
+      secondFrames = 0;
+      secondBytes = 0;
+    }
+  }
+  if (!ok) {
+    fprintf(stderr, "stream ended early\n");
+  }
+  close(fd);
+
+  report(frames, start, nowMicros(), !raw, c, sync, written, variant);
+  bool conforms = c.badMagic == 0 && c.badVersion == 0 && c.unknownTypes == 0 && c.badJpeg == 0 &&
+                  c.reordered == 0 && c.noJpegHeader == 0 && c.badSize == 0;
+  return ok && conforms ? 0 : 1;
+}
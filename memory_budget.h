@@ -0,0 +1,133 @@
+#pragma once
+#include <string.h>
+#include "esp_camera.h"
+#include "esp_heap_caps.h"
+#include "lwip/opt.h"
+
+// Internal RAM that has to stay free once everything is set up: every
+// client's lwIP send buffer, plus MEMORY_RESERVE_KB for Wi-Fi, pbufs and
+// the motion detector, which allocate while streaming. Camera buffers, the
+// frame ring and the spool are made smaller or left out to keep it free.
+#define MEMORY_RESERVE_DRAM (MEMORY_RESERVE_KB * 1024 + (MULTI_STREAM ? 2 : 1) * MAX_CLIENTS * TCP_SND_BUF)
+// PSRAM kept free, e.g. for decoding frames for the motion detector
+#define MEMORY_RESERVE_PSRAM (64 * 1024)
+// The camera driver sizes JPEG frame buffers for this compression ratio
+#define CAMERA_JPEG_RATIO 5
+#define MEMORY_MAX_ENTRIES 12
+
+#define MEMORY_DRAM (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#define MEMORY_PSRAM (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+
+struct MemoryUse {
+  const char *name;
+  int32_t dram;
+  int32_t psram;
+};
+
+// What the subsystems took at startup, reported once streaming starts.
+struct MemoryBudget {
+  MemoryUse entries[MEMORY_MAX_ENTRIES];
+  int count;
+  bool lowReported; // the reserve was eaten into at runtime
+};
+
+// Free memory at some point, to measure what was allocated since
+struct MemoryMark {
+  size_t dram;
+  size_t psram;
+  int entries;
+};
+
+static MemoryBudget memoryBudget;
+
+// Records what `name` uses, replacing an earlier record of it.
+void memoryRecord(const char *name, int32_t dram, int32_t psram) {
+  int i = 0;
+  while (i < memoryBudget.count && strcmp(memoryBudget.entries[i].name, name) != 0) {
+    i++;
+  }
+  if (i == MEMORY_MAX_ENTRIES) {
+    return;
+  }
+  memoryBudget.entries[i] = { name, dram, psram };
+  memoryBudget.count = max(memoryBudget.count, i + 1);
+}
+
+MemoryMark memoryMark() {
+  return { heap_caps_get_free_size(MEMORY_DRAM), heap_caps_get_free_size(MEMORY_PSRAM), memoryBudget.count };
+}
+
+// Records everything allocated since `mark` as `name`, except what was
+// recorded on its own in the meantime.
+void memoryRecordSince(const char *name, const MemoryMark &mark) {
+  MemoryMark now = memoryMark();
+  int32_t dram = (int32_t)mark.dram - (int32_t)now.dram;
+  int32_t psram = (int32_t)mark.psram - (int32_t)now.psram;
+  for (int i = mark.entries; i < now.entries; i++) {
+    dram -= memoryBudget.entries[i].dram;
+    psram -= memoryBudget.entries[i].psram;
+  }
+  memoryRecord(name, dram, psram);
+}
+
+// Whether `count` pieces of `size` bytes can be allocated in DRAM or PSRAM
+// without eating into the reserve.
+bool memoryFits(bool psram, size_t size, int count = 1) {
+  uint32_t caps = psram ? MEMORY_PSRAM : MEMORY_DRAM;
+  size_t reserve = psram ? MEMORY_RESERVE_PSRAM : MEMORY_RESERVE_DRAM;
+  return heap_caps_get_largest_free_block(caps) >= size && heap_caps_get_free_size(caps) >= size * count + reserve;
+}
+
+// PSRAM that can be allocated in one piece without eating into the reserve.
+size_t memoryPsramAvailable() {
+  size_t free = heap_caps_get_free_size(MEMORY_PSRAM);
+  size_t available = free > MEMORY_RESERVE_PSRAM ? free - MEMORY_RESERVE_PSRAM : 0;
+  return min(available, heap_caps_get_largest_free_block(MEMORY_PSRAM));
+}
+
+static size_t cameraBufferSize(framesize_t framesize, pixformat_t format) {
+  size_t pixels = (size_t)resolution[framesize].width * resolution[framesize].height;
+  if (format == PIXFORMAT_JPEG) {
+    return pixels / CAMERA_JPEG_RATIO;
+  }
+  return format == PIXFORMAT_GRAYSCALE ? pixels : pixels * 2;
+}
+
+// Declared in camera_config.h: the largest frame size up to `framesize`
+// whose `fbCount` frame buffers fit the budget, recorded as the camera's.
+framesize_t budgetCameraBuffers(framesize_t framesize, uint8_t fbCount, pixformat_t format, bool psram) {
+  framesize_t fitting = framesize;
+  size_t size = cameraBufferSize(fitting, format);
+  // The driver allocates the buffers one by one
+  while (fitting > 0 && !memoryFits(psram, size, fbCount)) {
+    fitting = (framesize_t)(fitting - 1);
+    size = cameraBufferSize(fitting, format);
+  }
+  if (fitting != framesize) {
+    Serial.printf("Frame buffers of frame size %d don't fit in memory, using %d\n", framesize, fitting);
+  }
+  memoryRecord("camera buffers", psram ? 0 : size * fbCount, psram ? size * fbCount : 0);
+  return fitting;
+}
+
+// Prints what every subsystem took and the least memory that was free.
+void memoryReport() {
+  Serial.println("Memory:              DRAM kB  PSRAM kB");
+  for (int i = 0; i < memoryBudget.count; i++) {
+    const MemoryUse &use = memoryBudget.entries[i];
+    Serial.printf("  %-18s %7.1f %9.1f\n", use.name, use.dram / 1024.0, use.psram / 1024.0);
+  }
+  Serial.printf("  %-18s %7.1f %9.1f\n", "free", heap_caps_get_free_size(MEMORY_DRAM) / 1024.0,
+                heap_caps_get_free_size(MEMORY_PSRAM) / 1024.0);
+  Serial.printf("  %-18s %7.1f %9.1f\n", "least free", heap_caps_get_minimum_free_size(MEMORY_DRAM) / 1024.0,
+                heap_caps_get_minimum_free_size(MEMORY_PSRAM) / 1024.0);
+}
+
+// Warns once when the free internal RAM has dropped below the reserve.
+void memoryCheck() {
+  if (!memoryBudget.lowReported && heap_caps_get_free_size(MEMORY_DRAM) < MEMORY_RESERVE_DRAM) {
+    memoryBudget.lowReported = true;
+    Serial.printf("Free memory dropped below the %u byte reserve\n", (unsigned)MEMORY_RESERVE_DRAM);
+    memoryReport();
+  }
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include <stdlib.h>
+#include "esp_camera.h"
+#include "esp_timer.h"
+#include "img_converters.h"
+#include "esp_heap_caps.h"
+
+// Luma signature grid compared between successive frames
+#define MOTION_GRID_WIDTH 16
+#define MOTION_GRID_HEIGHT 12
+// Keep streaming this long after the last motion (ms)
+#define MOTION_HOLD_MS 3000
+// Send one frame this often while nothing moves (ms)
+#define MOTION_KEEPALIVE_MS 5000
+
+// Mean change of the cell brightness (0 to 255) that counts as motion.
+// Starts at MOTION_THRESHOLD, can be changed over the control channel.
+static volatile uint8_t motionThreshold = MOTION_THRESHOLD;
+
+// Decides which frames are worth sending. Every frame is decoded at 1/8
+// scale, which only evaluates the DC coefficient of each 8x8 JPEG block,
+// and averaged into a small luma grid. A frame counts as motion when the
+// mean absolute difference to the previous grid exceeds motionThreshold.
+struct MotionDetector {
+  uint8_t signature[MOTION_GRID_WIDTH * MOTION_GRID_HEIGHT];
+  bool hasSignature;
+  uint8_t *decoded; // 1/8 scale RGB565 image
+  size_t decodedSize;
+  int64_t lastMotion;
+  int64_t lastSent;
+  uint32_t onsets; // times motion started after MOTION_HOLD_MS of stillness
+};
+
+static bool motionSignature(MotionDetector &motion, const camera_fb_t *fb, uint8_t *signature) {
+  size_t width = fb->width / 8;
+  size_t height = fb->height / 8;
+  if (width < MOTION_GRID_WIDTH || height < MOTION_GRID_HEIGHT) {
+    return false;
+  }
+  size_t size = width * height * 2;
+  if (size > motion.decodedSize) {
+    heap_caps_free(motion.decoded);
+    motion.decoded = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!motion.decoded) {
+      motion.decoded = (uint8_t *)malloc(size);
+    }
+    motion.decodedSize = motion.decoded ? size : 0;
+  }
+  if (!motion.decoded || !jpg2rgb565(fb->buf, fb->len, motion.decoded, JPG_SCALE_8X)) {
+    return false;
+  }
+
+  uint32_t sums[MOTION_GRID_WIDTH * MOTION_GRID_HEIGHT] = {};
+  uint32_t counts[MOTION_GRID_WIDTH * MOTION_GRID_HEIGHT] = {};
+  for (size_t y = 0; y < height; y++) {
+    const uint8_t *row = motion.decoded + y * width * 2;
+    size_t cellRow = y * MOTION_GRID_HEIGHT / height * MOTION_GRID_WIDTH;
+    for (size_t x = 0; x < width; x++) {
+      // jpg2rgb565 writes big-endian pixels
+      uint16_t pixel = row[x * 2] << 8 | row[x * 2 + 1];
+      uint32_t r = (pixel >> 8) & 0xf8;
+      uint32_t g = (pixel >> 3) & 0xfc;
+      uint32_t b = (pixel << 3) & 0xf8;
+      size_t cell = cellRow + x * MOTION_GRID_WIDTH / width;
+      sums[cell] += (r * 77 + g * 150 + b * 29) >> 8;
+      counts[cell]++;
+    }
+  }
+  for (int i = 0; i < MOTION_GRID_WIDTH * MOTION_GRID_HEIGHT; i++) {
+    signature[i] = sums[i] / counts[i];
+  }
+  return true;
+}
+
+// Returns true if `fb` should be streamed: it differs enough from the
+// previous frame, motion was seen less than MOTION_HOLD_MS ago, or no frame
+// has been sent for MOTION_KEEPALIVE_MS.
+bool motionGate(MotionDetector &motion, const camera_fb_t *fb) {
+  int64_t now = esp_timer_get_time();
+  uint8_t signature[MOTION_GRID_WIDTH * MOTION_GRID_HEIGHT];
+
+  if (fb->format != PIXFORMAT_JPEG || !motionSignature(motion, fb, signature)) {
+    // Nothing to compare with, don't hold anything back
+    motion.lastSent = now;
+    return true;
+  }
+
+  if (motion.hasSignature) {
+    uint32_t difference = 0;
+    for (int i = 0; i < MOTION_GRID_WIDTH * MOTION_GRID_HEIGHT; i++) {
+      difference += abs(signature[i] - motion.signature[i]);
+    }
+    if (difference > (uint32_t)motionThreshold * MOTION_GRID_WIDTH * MOTION_GRID_HEIGHT) {
+      if (now - motion.lastMotion >= MOTION_HOLD_MS * 1000LL) {
+        motion.onsets++;
+      }
+      motion.lastMotion = now;
+    }
+  } else {
+    motion.lastMotion = now;
+  }
+  memcpy(motion.signature, signature, sizeof(signature));
+  motion.hasSignature = true;
+
+  if (now - motion.lastMotion < MOTION_HOLD_MS * 1000LL ||
+      now - motion.lastSent >= MOTION_KEEPALIVE_MS * 1000LL) {
+    motion.lastSent = now;
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,134 @@
+#pragma once
+#include "esp_camera.h"
+#include "esp_timer.h"
+#include "frame_pacer.h"
+#include "frame_stream.h"
+#include "camera_control.h"
+
+#if MULTI_STREAM && !PIPELINE_TASKS
+#error "MULTI_STREAM needs PIPELINE_TASKS"
+#endif
+#if MULTI_STREAM && ADAPTIVE_BITRATE
+#error "ADAPTIVE_BITRATE only controls a single stream"
+#endif
+
+// Frames read after switching the sensor to another stream's settings
+// before giving up on getting one of the new size
+#define STREAM_SWITCH_ATTEMPTS 4
+
+struct StreamProfile {
+  framesize_t framesize;
+  int quality;
+  FramePacer pacer;
+  uint32_t sequence; // frame counter of this stream
+};
+
+// Several streams of different size, quality and rate from one sensor.
+// The sensor only produces one size at a time, so the streams take turns:
+// the one whose next deadline comes first has its settings applied and is
+// captured. Frames the driver completed before the switch still have the
+// previous size and are discarded.
+struct MultiStream {
+  StreamProfile profiles[STREAM_COUNT];
+  volatile bool wanted[STREAM_COUNT]; // set by the network side
+};
+
+void profileBegin(StreamProfile &profile, framesize_t framesize, int quality, float fps) {
+  // Frame buffers can't hold anything larger than they were allocated for
+  if (framesize > cameraMaxFramesize) {
+    Serial.printf("Frame size %d too large, using %d\n", framesize, cameraMaxFramesize);
+    framesize = cameraMaxFramesize;
+  }
+  profile.framesize = framesize;
+  profile.quality = quality;
+  pacerSetFps(profile.pacer, fps);
+}
+
+void multiStreamReset(MultiStream &streams) {
+  for (int i = 0; i < STREAM_COUNT; i++) {
+    pacerReset(streams.profiles[i].pacer);
+  }
+}
+
+static void applyProfile(StreamProfile &profile, int stream) {
+  CameraSettings settings;
+  if (takePendingSettings(stream, settings)) {
+    if (settings.framesize >= 0) {
+      profile.framesize = (framesize_t)settings.framesize;
+    }
+    if (settings.quality >= 0) {
+      profile.quality = settings.quality;
+    }
+    if (settings.fps > 0) {
+      pacerSetFps(profile.pacer, settings.fps);
+    }
+    if (settings.setSensorProfile) {
+      applySensorProfile(esp_camera_sensor_get(), settings.sensorProfile);
+    }
+    Serial.printf("Stream %d: frame size %d, quality %d, %.2f fps\n",
+                  stream, profile.framesize, profile.quality, profile.pacer.targetFps);
+  }
+
+  // The setters write sensor registers, skip them when nothing changes
+  sensor_t *s = esp_camera_sensor_get();
+  if (s->status.framesize != profile.framesize) {
+    s->set_framesize(s, profile.framesize);
+    applySensorRegisters(s);
+  }
+  if (s->status.quality != profile.quality) {
+    s->set_quality(s, profile.quality);
+  }
+}
+
+// Blocks until the next frame of any wanted stream is due and sets the
+// sensor up for it. Returns the stream, or -1 if no stream is wanted.
+int multiStreamWait(MultiStream &streams) {
+  int64_t now = esp_timer_get_time();
+  int next = -1;
+  for (int i = 0; i < STREAM_COUNT; i++) {
+    FramePacer &pacer = streams.profiles[i].pacer;
+    if (!streams.wanted[i]) {
+      pacerReset(pacer);
+      continue;
+    }
+    pacerStart(pacer, now);
+    if (next < 0 || pacer.deadline < streams.profiles[next].pacer.deadline) {
+      next = i;
+    }
+  }
+  if (next < 0) {
+    return -1;
+  }
+
+  StreamProfile &profile = streams.profiles[next];
+  if (now < profile.pacer.deadline) {
+    vTaskDelay(pdMS_TO_TICKS((profile.pacer.deadline - now) / 1000));
+    int64_t woken = esp_timer_get_time();
+    loadWaited(LOAD_CAPTURE, woken - now);
+    now = woken;
+  }
+  pacerAdvance(profile.pacer, now);
+  applyProfile(profile, next);
+  return next;
+}
+
+// Captures a frame for `stream` after multiStreamWait() returned it.
+bool multiStreamCapture(MultiStream &streams, int stream, CapturedFrame &frame) {
+  StreamProfile &profile = streams.profiles[stream];
+  const resolution_info_t &size = resolution[profile.framesize];
+  for (int attempt = 0; attempt < STREAM_SWITCH_ATTEMPTS; attempt++) {
+    if (!captureFrame(frame)) {
+      return false;
+    }
+    // Frames the sensor had started before the switch still have the old
+    // size, captureFrame() took it from the JPEG
+    if (frame.fb->width == size.width && frame.fb->height == size.height) {
+      frame.stream = stream;
+      frame.header.sequence = profile.sequence++;
+      return true;
+    }
+    esp_camera_fb_return(frame.fb);
+    statsCount(COUNTER_STALE_FRAMES);
+  }
+  return false;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <ArduinoOTA.h>
+#include "frame_pipeline.h"
+
+// Firmware updates over Wi-Fi, e.g. the builds of tools/build_variants.sh
+// uploaded with espota.py or the Arduino IDE. Needs a partition scheme
+// with two app partitions.
+
+void otaBegin(const char *hostname, const char *password) {
+  ArduinoOTA.setHostname(hostname);
+  if (password[0]) {
+    ArduinoOTA.setPassword(password);
+  }
+  // The upload runs within otaHandle() on the network side, capturing
+  // would only take CPU time and memory from it
+  ArduinoOTA.onStart([]() {
+    streamActive = false;
+    Serial.println("Firmware update started");
+  });
+  ArduinoOTA.onEnd([]() {
+    Serial.println("Firmware update written, restarting");
+  });
+  ArduinoOTA.onError([](ota_error_t error) {
+    Serial.printf("Firmware update failed: %d\n", error);
+  });
+  ArduinoOTA.begin();
+  Serial.printf("Firmware updates as %s.local\n", hostname);
+}
+
+void otaHandle() {
+  ArduinoOTA.handle();
+}
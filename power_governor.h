@@ -0,0 +1,128 @@
+#pragma once
+#include "esp_timer.h"
+#include "camera_control.h"
+#include "task_load.h"
+
+// How often the governor looks at load, temperature and supply (ms)
+#define GOVERNOR_INTERVAL_MS 2000
+// Share of the time the busier task may work before it is out of headroom
+#define GOVERNOR_BUSY_HIGH 0.8
+// Below this the CPU clock is lowered, if the load would stay below
+// GOVERNOR_BUSY_HIGH at the lower clock
+#define GOVERNOR_BUSY_LOW 0.4
+// Factor the frame rate changes by with every step
+#define GOVERNOR_STEP 0.8f
+// Temperature and supply have to recover this far before the frame rate
+// goes back up
+#define GOVERNOR_TEMP_HYSTERESIS 5
+#define GOVERNOR_SUPPLY_HYSTERESIS_MV 100
+
+// Clocks the governor chooses from, Wi-Fi needs at least 80 MHz
+static const uint32_t governorFrequencies[] = { 80, 160, 240 };
+#define GOVERNOR_FREQUENCY_COUNT (int)(sizeof(governorFrequencies) / sizeof(governorFrequencies[0]))
+
+// Scales the frame rate of the primary stream, and the CPU clock, to what
+// the power and thermal state can sustain. Work goes first when the chip
+// runs hot or the supply sags, then the clock; a task running out of idle
+// time gets a faster clock first, then less work.
+struct PowerGovernor {
+  float ceiling;  // FPS, or the rate a client set last
+  float fps;      // rate the governor asked for
+  float observed; // the pacer's rate at the last check
+  int frequency;  // index into governorFrequencies
+  uint32_t idle[LOAD_TASKS];
+  int64_t lastCheck;
+};
+
+void governorBegin(PowerGovernor &governor, float fps) {
+  governor.ceiling = fps;
+  governor.fps = fps;
+  governor.observed = fps;
+  governor.frequency = GOVERNOR_FREQUENCY_COUNT - 1;
+  for (int i = 0; i < GOVERNOR_FREQUENCY_COUNT; i++) {
+    if (governorFrequencies[i] == getCpuFrequencyMhz()) {
+      governor.frequency = i;
+    }
+  }
+  for (int i = 0; i < LOAD_TASKS; i++) {
+    governor.idle[i] = loadIdle[i];
+  }
+  governor.lastCheck = esp_timer_get_time();
+}
+
+// The load the busier task would have at `to` instead of `from` MHz.
+static float governorScaledLoad(float busy, int from, int to) {
+  return busy * governorFrequencies[from] / governorFrequencies[to];
+}
+
+// Called regularly by the network side with the frame rate the primary
+// stream's pacer is running at.
+void governorUpdate(PowerGovernor &governor, float pacerFps) {
+  int64_t now = esp_timer_get_time();
+  int64_t elapsed = now - governor.lastCheck;
+  if (elapsed < GOVERNOR_INTERVAL_MS * 1000LL) {
+    return;
+  }
+  governor.lastCheck = now;
+  float busy = 0;
+  for (int i = 0; i < LOAD_TASKS; i++) {
+    uint32_t idle = loadIdle[i];
+    busy = max(busy, 1 - (float)(uint32_t)(idle - governor.idle[i]) / elapsed);
+    governor.idle[i] = idle;
+  }
+  // A rate set with CONTROL_SET_FPS becomes the new ceiling
+  if (pacerFps != governor.observed && pacerFps != governor.fps) {
+    governor.ceiling = pacerFps;
+    governor.fps = pacerFps;
+  }
+  governor.observed = pacerFps;
+
+  float temperature = temperatureRead();
+#if GOVERNOR_SUPPLY_PIN >= 0
+  int supply = analogReadMilliVolts(GOVERNOR_SUPPLY_PIN) * GOVERNOR_SUPPLY_DIVIDER;
+  bool sagging = supply < GOVERNOR_MIN_SUPPLY_MV;
+  bool supplyRecovered = supply > GOVERNOR_MIN_SUPPLY_MV + GOVERNOR_SUPPLY_HYSTERESIS_MV;
+#else
+  int supply = 0;
+  bool sagging = false;
+  bool supplyRecovered = true;
+#endif
+  bool hot = temperature > GOVERNOR_MAX_TEMP_C;
+  bool recovered = supplyRecovered && temperature < GOVERNOR_MAX_TEMP_C - GOVERNOR_TEMP_HYSTERESIS;
+
+  float fps = governor.fps;
+  int frequency = governor.frequency;
+  bool slower = frequency > 0 && governorScaledLoad(busy, frequency, frequency - 1) < GOVERNOR_BUSY_HIGH;
+  if (hot || sagging) {
+    if (fps > GOVERNOR_MIN_FPS) {
+      fps = max(fps * GOVERNOR_STEP, (float)GOVERNOR_MIN_FPS);
+    } else if (slower) {
+      frequency--;
+    }
+  } else if (busy > GOVERNOR_BUSY_HIGH) {
+    if (frequency < GOVERNOR_FREQUENCY_COUNT - 1) {
+      frequency++;
+    } else {
+      fps = max(fps * GOVERNOR_STEP, (float)GOVERNOR_MIN_FPS);
+    }
+  } else if (recovered && fps < governor.ceiling && busy / GOVERNOR_STEP < GOVERNOR_BUSY_HIGH) {
+    fps = min(fps / GOVERNOR_STEP, governor.ceiling);
+  } else if (busy < GOVERNOR_BUSY_LOW && slower) {
+    frequency--;
+  }
+
+  if (frequency == governor.frequency && fps == governor.fps) {
+    return;
+  }
+  if (frequency != governor.frequency) {
+    setCpuFrequencyMhz(governorFrequencies[frequency]);
+    governor.frequency = frequency;
+  }
+  if (fps != governor.fps) {
+    CameraSettings changes = { -1, -1, fps };
+    requestSettings(0, changes);
+    governor.fps = fps;
+  }
+  Serial.printf("Governor: %.0f C, %d mV, %.0f%% busy: %.1f fps at %u MHz\n", temperature, supply, busy * 100, fps,
+                governorFrequencies[frequency]);
+}
@@ -0,0 +1,257 @@
+#pragma once
+#include <stdio.h>
+#include <unistd.h>
+#if SD_SPOOL
+#include "SD_MMC.h"
+#endif
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "frame_stream.h"
+#include "memory_budget.h"
+
+#if SD_SPOOL && !FRAMED_STREAM
+#error "SD_SPOOL needs FRAMED_STREAM to tell backlog frames from live ones"
+#endif
+
+// Frames are collected in PSRAM and written to the card this many bytes at
+// a time, SD cards are fastest with large sequential writes. Frames larger
+// than a block aren't spooled.
+#define SPOOL_BLOCK_SIZE (128 * 1024)
+#define SPOOL_MOUNT_POINT "/sdcard"
+#define SPOOL_PATH SPOOL_MOUNT_POINT "/spool.bin"
+
+// Work for the spool task. Only the spool task touches the file.
+enum SpoolOp : uint8_t {
+  SPOOL_WRITE, // append a full block
+  SPOOL_READ,  // read the file from `drained` into the drain block
+  SPOOL_RESET, // empty the file once everything was drained
+};
+
+struct SpoolRequest {
+  uint8_t op; // SpoolOp
+  uint8_t block;
+};
+
+// Frames captured while no client can receive them, appended to a file on
+// the SD card as backlog messages (header and image, as on the wire) and
+// sent to the first client once one is connected again. The capture side
+// fills one block while the spool task writes the other one, so capturing
+// never waits for the card.
+struct SdSpool {
+  FILE *file; // NULL without a card
+  QueueHandle_t requests;
+  uint8_t *blocks[2];
+  size_t blockLength[2];
+  volatile bool blockBusy[2]; // handed to the spool task
+  int current;                // block frames are appended to
+  volatile bool outage;
+  bool served;                // a client has been connected since boot
+  uint32_t maxBytes;
+  volatile uint32_t stored;   // bytes in the file
+  // Bytes of the file sent to a client. Owned by the spool task while
+  // `reading`, by the network side otherwise.
+  uint32_t drained;
+  // Part of the file read back, starting at `drainStart`
+  uint8_t *drainBlock;
+  uint32_t drainStart;
+  size_t drainLength;
+  volatile bool reading;
+  bool sending;               // a client is writing the message at `drained`
+  uint32_t drainRate;         // bytes per second
+  int64_t nextDrain;
+};
+
+// Only the spool task and spoolBegin() touch the card. Without SD_SPOOL
+// they aren't built, so the SD_MMC library isn't linked in, and the rest
+// does nothing with no file open.
+#if SD_SPOOL
+static void spoolTask(void *arg) {
+  SdSpool &spool = *(SdSpool *)arg;
+  SpoolRequest request;
+  for (;;) {
+    xQueueReceive(spool.requests, &request, portMAX_DELAY);
+    if (request.op == SPOOL_WRITE) {
+      size_t length = spool.blockLength[request.block];
+      fseek(spool.file, 0, SEEK_END);
+      bool ok = fwrite(spool.blocks[request.block], 1, length, spool.file) == length;
+      fflush(spool.file);
+      fsync(fileno(spool.file));
+      if (ok) {
+        spool.stored += length;
+      } else {
+        Serial.println("Failed to write to the SD card");
+        statsCount(COUNTER_SPOOL_DROPS);
+      }
+      spool.blockLength[request.block] = 0;
+      spool.blockBusy[request.block] = false;
+    } else if (request.op == SPOOL_READ) {
+      fseek(spool.file, spool.drained, SEEK_SET);
+      spool.drainStart = spool.drained;
+      spool.drainLength = fread(spool.drainBlock, 1, min((uint32_t)SPOOL_BLOCK_SIZE, spool.stored - spool.drained),
+                                spool.file);
+      spool.reading = false;
+    } else if (request.op == SPOOL_RESET) {
+      // A block may have been appended since the reset was requested
+      if (spool.drained == spool.stored) {
+        ftruncate(fileno(spool.file), 0);
+        spool.stored = 0;
+        spool.drained = 0;
+        spool.drainStart = 0;
+        spool.drainLength = 0;
+      }
+      spool.reading = false;
+    }
+  }
+}
+
+// Mounts the card and opens the spool file. Backlog left from before a
+// restart is kept and drained like any other. Returns false, and spools
+// nothing, without a card.
+bool spoolBegin(SdSpool &spool, uint32_t maxBytes, uint32_t drainRate) {
+  // 1-bit mode leaves GPIO 4, the flash LED on most boards, alone
+  if (!SD_MMC.begin(SPOOL_MOUNT_POINT, true)) {
+    Serial.println("No SD card, not spooling");
+    return false;
+  }
+  if (!memoryFits(true, SPOOL_BLOCK_SIZE, 3)) {
+    Serial.println("Not enough memory for the SD card spool");
+    return false;
+  }
+  for (int i = 0; i < 2; i++) {
+    spool.blocks[i] = (uint8_t *)heap_caps_malloc(SPOOL_BLOCK_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  }
+  spool.drainBlock = (uint8_t *)heap_caps_malloc(SPOOL_BLOCK_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  spool.requests = xQueueCreate(4, sizeof(SpoolRequest));
+  spool.file = fopen(SPOOL_PATH, "a+b");
+  if (!spool.blocks[0] || !spool.blocks[1] || !spool.drainBlock || !spool.requests || !spool.file ||
+      xTaskCreate(spoolTask, "spool", 4096, &spool, 3, NULL) != pdPASS) {
+    Serial.println("Failed to set up the SD card spool");
+    spool.file = NULL;
+    return false;
+  }
+  fseek(spool.file, 0, SEEK_END);
+  spool.stored = ftell(spool.file);
+  memoryRecord("SD card spool", 0, 3 * SPOOL_BLOCK_SIZE);
+  spool.maxBytes = maxBytes;
+  spool.drainRate = drainRate;
+  Serial.printf("Spooling to SD card, %u bytes of backlog\n", (unsigned)spool.stored);
+  return true;
+}
+#endif
+
+// Called by the network side with the number of connected clients. An
+// outage is the Wi-Fi being down, or every client gone after the first
+// one had connected.
+void spoolUpdate(SdSpool &spool, bool wifiConnected, int clients) {
+  spool.served = spool.served || clients > 0;
+  spool.outage = spool.file && (!wifiConnected || (spool.served && clients == 0));
+}
+
+// Hands the current block to the spool task and continues with the other
+// one. Returns false if that one is still being written.
+static bool spoolFlush(SdSpool &spool) {
+  int next = 1 - spool.current;
+  if (spool.blockBusy[next]) {
+    return false;
+  }
+  SpoolRequest request = { SPOOL_WRITE, (uint8_t)spool.current };
+  spool.blockBusy[spool.current] = true;
+  xQueueSend(spool.requests, &request, portMAX_DELAY);
+  spool.current = next;
+  return true;
+}
+
+// Appends the frame to the spool during an outage, and writes out what was
+// collected once it is over. Called by the capture side for every frame it
+// keeps; this only copies, the card is written by the spool task.
+void spoolRecord(SdSpool &spool, const CapturedFrame &frame) {
+  if (!spool.file) {
+    return;
+  }
+  size_t &length = spool.blockLength[spool.current];
+  if (!spool.outage) {
+    if (length > 0) {
+      spoolFlush(spool);
+    }
+    return;
+  }
+
+  size_t total = sizeof(FrameHeader) + frame.header.length;
+  bool room = total <= SPOOL_BLOCK_SIZE &&
+              spool.stored + spool.blockLength[0] + spool.blockLength[1] + total <= spool.maxBytes;
+  if (room && length + total > SPOOL_BLOCK_SIZE) {
+    room = spoolFlush(spool);
+  }
+  if (!room) {
+    statsCount(COUNTER_SPOOL_DROPS);
+    return;
+  }
+  uint8_t *block = spool.blocks[spool.current];
+  FrameHeader header = frame.header;
+  header.type = MESSAGE_BACKLOG_FRAME;
+  memcpy(block + length, &header, sizeof(header));
+  memcpy(block + length + sizeof(header), frame.fb->buf, header.length);
+  spool.blockLength[spool.current] += total;
+  statsCount(COUNTER_FRAMES_SPOOLED);
+}
+
+// The next backlog message if it is due, read back in blocks by the spool
+// task in the meantime. The message stays in place until spoolSent() or
+// spoolUnsent(). Draining is limited to `drainRate` so live frames keep
+// most of the link.
+bool spoolNext(SdSpool &spool, const FrameHeader *&header, const uint8_t *&payload, int64_t now) {
+  if (spool.reading || spool.sending || !spool.file || spool.outage || now < spool.nextDrain) {
+    return false;
+  }
+  if (spool.drained == spool.stored) {
+    if (spool.stored > 0) {
+      SpoolRequest request = { SPOOL_RESET, 0 };
+      spool.reading = true;
+      xQueueSend(spool.requests, &request, portMAX_DELAY);
+    }
+    return false;
+  }
+
+  size_t offset = spool.drained - spool.drainStart;
+  const FrameHeader *next = (const FrameHeader *)(spool.drainBlock + offset);
+  bool inBlock = spool.drained >= spool.drainStart && offset + sizeof(FrameHeader) <= spool.drainLength &&
+                 offset + sizeof(FrameHeader) + next->length <= spool.drainLength;
+  if (!inBlock) {
+    if (offset != 0 || spool.drainLength == 0) {
+      SpoolRequest request = { SPOOL_READ, 0 };
+      spool.reading = true;
+      xQueueSend(spool.requests, &request, portMAX_DELAY);
+      return false;
+    }
+    // Doesn't fit a block although it was read from its start, or a
+    // message cut short by a restart
+    Serial.println("Discarding corrupt SD card backlog");
+    spool.drained = spool.stored;
+    return false;
+  }
+  if (next->magic != STREAM_MAGIC || next->type != MESSAGE_BACKLOG_FRAME) {
+    Serial.println("Discarding corrupt SD card backlog");
+    spool.drained = spool.stored;
+    return false;
+  }
+  header = next;
+  payload = (const uint8_t *)(next + 1);
+  spool.sending = true;
+  spool.nextDrain = max(spool.nextDrain, now) + (sizeof(FrameHeader) + next->length) * 1000000LL / spool.drainRate;
+  return true;
+}
+
+// The message spoolNext() returned was written completely.
+void spoolSent(SdSpool &spool, const FrameHeader &header) {
+  spool.drained += sizeof(FrameHeader) + header.length;
+  spool.sending = false;
+  statsCount(COUNTER_BACKLOG_SENT);
+}
+
+// The client writing it is gone, the message is sent again later.
+void spoolUnsent(SdSpool &spool) {
+  spool.sending = false;
+}
@@ -0,0 +1,117 @@
+#pragma once
+#include "esp_camera.h"
+#include "stream_protocol.h"
+
+// Timer the camera driver generates XCLK with (see camera_config.h)
+#define SENSOR_XCLK_TIMER LEDC_TIMER_0
+// Tuning fields left at this value keep what the driver started with
+#define TUNING_BOOT -128
+
+// OV2640 registers are addressed with the bank in bit 8, 1 = sensor bank.
+// CLKRC: bit 7 doubles the internal clock, bits 5-0 divide it by n + 1.
+// The driver rewrites it with every frame size, for JPEG to 0.
+#define OV2640_CLKRC 0x111
+
+struct SensorRegister {
+  uint16_t reg;
+  uint8_t mask;
+  uint8_t value;
+};
+
+#define TUNING_MAX_REGISTERS 2
+
+// One profile for one sensor. The clock decides the frame rate the sensor
+// can reach and, through the frame time, the longest exposure: halving
+// XCLK halves the rate and doubles the exposure available in the dark.
+// The gain ceiling trades noise, which JPEG spends most bytes on, for
+// brightness.
+struct SensorTuning {
+  uint16_t pid;
+  uint8_t profile;        // SensorProfile
+  uint8_t xclkMhz;
+  int8_t gainCeiling;     // gainceiling_t
+  int8_t aec2;            // AEC DSP on the OV2640, night mode on the others
+  int8_t aeLevel;         // exposure target, -2 to 2
+  int8_t denoise;         // OV3660 and OV5640 only
+  uint8_t registerCount;  // written after the frame size, JPEG only
+  SensorRegister registers[TUNING_MAX_REGISTERS];
+};
+
+static const SensorTuning sensorTunings[] = {
+  { OV2640_PID, SENSOR_PROFILE_DEFAULT, 20, TUNING_BOOT, TUNING_BOOT, TUNING_BOOT, TUNING_BOOT,
+    1, { { OV2640_CLKRC, 0xbf, 0x00 } } },
+  // The internal clock doubler reaches 30+ fps up to CIF
+  { OV2640_PID, SENSOR_PROFILE_MAX_FPS, 20, GAINCEILING_4X, 0, 0, TUNING_BOOT,
+    1, { { OV2640_CLKRC, 0xbf, 0x80 } } },
+  { OV2640_PID, SENSOR_PROFILE_LOW_LIGHT, 10, GAINCEILING_32X, 1, 1, TUNING_BOOT,
+    1, { { OV2640_CLKRC, 0xbf, 0x00 } } },
+  { OV2640_PID, SENSOR_PROFILE_LOW_BANDWIDTH, 10, GAINCEILING_2X, 0, 0, TUNING_BOOT,
+    1, { { OV2640_CLKRC, 0xbf, 0x00 } } },
+
+  // These derive their PLL from XCLK, and 24 MHz is the highest both take
+  { OV3660_PID, SENSOR_PROFILE_DEFAULT, 20, TUNING_BOOT, TUNING_BOOT, TUNING_BOOT, TUNING_BOOT, 0 },
+  { OV3660_PID, SENSOR_PROFILE_MAX_FPS, 24, GAINCEILING_4X, 0, 0, 0, 0 },
+  { OV3660_PID, SENSOR_PROFILE_LOW_LIGHT, 12, GAINCEILING_32X, 1, 1, 1, 0 },
+  { OV3660_PID, SENSOR_PROFILE_LOW_BANDWIDTH, 12, GAINCEILING_2X, 0, 0, 1, 0 },
+
+  { OV5640_PID, SENSOR_PROFILE_DEFAULT, 20, TUNING_BOOT, TUNING_BOOT, TUNING_BOOT, TUNING_BOOT, 0 },
+  { OV5640_PID, SENSOR_PROFILE_MAX_FPS, 24, GAINCEILING_4X, 0, 0, 0, 0 },
+  { OV5640_PID, SENSOR_PROFILE_LOW_LIGHT, 12, GAINCEILING_32X, 1, 1, 1, 0 },
+  { OV5640_PID, SENSOR_PROFILE_LOW_BANDWIDTH, 12, GAINCEILING_2X, 0, 0, 1, 0 },
+};
+
+#define SENSOR_TUNING_COUNT (sizeof(sensorTunings) / sizeof(sensorTunings[0]))
+
+// Profile in effect, its registers are written again after every frame size
+// change. Only touched by whoever captures.
+static const SensorTuning *sensorTuning = NULL;
+// Settings the driver started with, saved before the first profile
+static camera_status_t bootStatus;
+
+const SensorTuning *findSensorTuning(uint16_t pid, int profile) {
+  for (size_t i = 0; i < SENSOR_TUNING_COUNT; i++) {
+    if (sensorTunings[i].pid == pid && sensorTunings[i].profile == profile) {
+      return &sensorTunings[i];
+    }
+  }
+  return NULL;
+}
+
+static int tuningValue(int8_t value, int boot) {
+  return value == TUNING_BOOT ? boot : value;
+}
+
+// Writes the profile's registers, which the driver resets when it sets up
+// a frame size or window.
+void applySensorRegisters(sensor_t *s) {
+  if (!sensorTuning || s->pixformat != PIXFORMAT_JPEG) {
+    return;
+  }
+  for (int i = 0; i < sensorTuning->registerCount; i++) {
+    const SensorRegister &r = sensorTuning->registers[i];
+    s->set_reg(s, r.reg, r.mask, r.value);
+  }
+}
+
+// Switches the sensor to `profile`. Returns false if there is none for it.
+bool applySensorProfile(sensor_t *s, int profile) {
+  const SensorTuning *tuning = findSensorTuning(s->id.PID, profile);
+  if (!tuning) {
+    return false;
+  }
+  if (!sensorTuning) {
+    bootStatus = s->status;
+  }
+  sensorTuning = tuning;
+  if (s->xclk_freq_hz != tuning->xclkMhz * 1000000) {
+    s->set_xclk(s, SENSOR_XCLK_TIMER, tuning->xclkMhz);
+  }
+  s->set_gainceiling(s, (gainceiling_t)tuningValue(tuning->gainCeiling, bootStatus.gainceiling));
+  s->set_aec2(s, tuningValue(tuning->aec2, bootStatus.aec2));
+  s->set_ae_level(s, tuningValue(tuning->aeLevel, bootStatus.ae_level));
+  if (s->id.PID != OV2640_PID) {
+    s->set_denoise(s, tuningValue(tuning->denoise, bootStatus.denoise));
+  }
+  applySensorRegisters(s);
+  return true;
+}
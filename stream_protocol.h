@@ -0,0 +1,224 @@
+// Wire format of the framed TCP stream. Shared by the firmware and the
+// host-side tools, so keep this file free of Arduino/ESP-IDF dependencies.
+#pragma once
+#include <stdint.h>
+
+// "ECAM" when read as bytes on the wire (all fields are little-endian).
+#define STREAM_MAGIC 0x4D414345
+#define STREAM_VERSION 1
+
+// Value of FrameHeader::type.
+enum MessageType : uint8_t {
+  MESSAGE_FRAME = 0,         // `length` bytes of image data follow the header
+  MESSAGE_CONTROL_REPLY = 1, // a ControlReply follows the header
+  MESSAGE_STATS = 2,         // a StatsRecord follows the header
+  MESSAGE_COMPACT_FRAME = 3, // a JPEG image without its header, see below
+  MESSAGE_BACKLOG_FRAME = 4, // a frame captured during an outage, sent late
+  MESSAGE_PONG = 5,          // a PongRecord answering CONTROL_PING
+  MESSAGE_FRAME_SENT = 6,    // a FrameSentRecord, after every frame
+};
+
+// Fixed size header written in front of every message. A receiver reads
+// sizeof(FrameHeader) bytes, checks `magic` and then reads exactly `length`
+// payload bytes; no scanning for JPEG markers is required.
+struct __attribute__((packed)) FrameHeader {
+  uint32_t magic;     // STREAM_MAGIC
+  uint8_t  version;   // STREAM_VERSION
+  uint8_t  type;      // MessageType
+  uint16_t format;    // pixformat_t of the payload (PIXFORMAT_JPEG = 4)
+  uint32_t length;    // payload length in bytes
+  uint32_t sequence;  // frame counter, increments by one per captured frame
+  uint64_t timestamp; // capture time in microseconds (fb->timestamp), for
+                      // other messages the time they started to be written
+  uint16_t width;
+  uint16_t height;
+};
+
+static_assert(sizeof(FrameHeader) == 28, "FrameHeader must be 28 bytes on the wire");
+
+// A compact frame is a JPEG image with everything up to the end of the
+// start of scan (SOS) segment left out. Those bytes are the same for every
+// frame of one size and quality, so a client receives them only in a full
+// MESSAGE_FRAME, which it needs to keep to rebuild the compact frames that
+// follow: the full frame's first jpegHeaderLength() bytes followed by the
+// compact payload make up the image again.
+static inline uint32_t jpegHeaderLength(const uint8_t *jpeg, uint32_t length) {
+  if (length < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) {
+    return 0;
+  }
+  uint32_t position = 2;
+  while (position + 4 <= length && jpeg[position] == 0xFF) {
+    uint8_t marker = jpeg[position + 1];
+    position += 2 + ((uint32_t)jpeg[position + 2] << 8 | jpeg[position + 3]);
+    if (marker == 0xDA) {
+      return position <= length ? position : 0;
+    }
+  }
+  return 0;
+}
+
+// Image size from a JPEG's start of frame segment. The driver reports the
+// configured frame size, which is wrong once a window is set with
+// set_res_raw(). The encoded image says what actually went out.
+static inline bool jpegDimensions(const uint8_t *jpeg, uint32_t length, uint16_t &width, uint16_t &height) {
+  if (length < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) {
+    return false;
+  }
+  uint32_t position = 2;
+  while (position + 4 <= length && jpeg[position] == 0xFF) {
+    uint8_t marker = jpeg[position + 1];
+    bool startOfFrame = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+    if (startOfFrame && position + 9 <= length) {
+      height = (uint16_t)jpeg[position + 5] << 8 | jpeg[position + 6];
+      width = (uint16_t)jpeg[position + 7] << 8 | jpeg[position + 8];
+      return width && height;
+    }
+    if (marker == 0xDA) {
+      return false;
+    }
+    position += 2 + ((uint32_t)jpeg[position + 2] << 8 | jpeg[position + 3]);
+  }
+  return false;
+}
+
+// Length of a JPEG image up to and including its end of image marker. The
+// camera may pad frames after it. FF D9 can't occur within the entropy
+// coded data, where FF is always followed by 00 or a restart marker.
+static inline uint32_t jpegTrimmedLength(const uint8_t *jpeg, uint32_t length) {
+  for (uint32_t end = length; end >= 4; end--) {
+    if (jpeg[end - 2] == 0xFF && jpeg[end - 1] == 0xD9) {
+      return end;
+    }
+  }
+  return length;
+}
+
+// Commands a client can send to the camera on the stream connection.
+enum ControlOpcode : uint8_t {
+  CONTROL_SET_FRAMESIZE = 1, // int32 framesize_t
+  CONTROL_SET_QUALITY = 2,   // int32 JPEG quality, 0 (best) to 63
+  CONTROL_SET_FPS = 3,       // int32 target frame rate in 1/100 fps
+  CONTROL_GET_STATS = 4,     // no payload, answered with a MESSAGE_STATS
+  CONTROL_SET_MOTION_THRESHOLD = 5, // int32 mean brightness change, 0 to 255
+  CONTROL_REPLAY = 6,        // int32 milliseconds of recorded frames to replay
+  CONTROL_SET_ROI = 7,       // uint16 x, y, width, height in full sensor pixels, width 0 clears
+  CONTROL_SET_SENSOR_PROFILE = 8, // int32 SensorProfile
+  CONTROL_PING = 9,          // uint64 client time, answered with a MESSAGE_PONG
+};
+
+// Clock, exposure and gain tunings of the sensor, see sensor_profiles.h.
+enum SensorProfile : uint8_t {
+  SENSOR_PROFILE_DEFAULT = 0,
+  SENSOR_PROFILE_MAX_FPS = 1,       // highest frame rate at small frame sizes
+  SENSOR_PROFILE_LOW_LIGHT = 2,     // longer exposures and more gain, lower rate
+  SENSOR_PROFILE_LOW_BANDWIDTH = 3, // slower clock and less noise, smaller frames
+};
+
+#define CONTROL_MAX_PAYLOAD 16
+
+// Every command starts with this header, followed by `length` payload bytes.
+struct __attribute__((packed)) ControlHeader {
+  uint8_t opcode; // ControlOpcode
+  uint8_t length; // payload bytes, at most CONTROL_MAX_PAYLOAD
+};
+
+enum ControlStatus : uint8_t {
+  CONTROL_OK = 0,
+  CONTROL_INVALID_VALUE = 1,
+  CONTROL_UNKNOWN_OPCODE = 2,
+  CONTROL_UNSUPPORTED = 3,   // not possible with this sensor or configuration
+};
+
+// Sent back for every command when the stream is framed.
+struct __attribute__((packed)) ControlReply {
+  uint8_t opcode; // ControlOpcode being answered
+  uint8_t status; // ControlStatus
+};
+
+// Payload of MESSAGE_PONG. Device times are microseconds since boot, the
+// clock frame timestamps are taken with. With t0 the client's time the ping
+// was sent, t1 = `received`, t2 the pong's FrameHeader::timestamp and t3
+// the client's time it arrived, the device clock is ((t1 - t0) + (t2 - t3))
+// / 2 ahead of the client's, to within half of the round trip
+// (t3 - t0) - (t2 - t1).
+struct __attribute__((packed)) PongRecord {
+  uint64_t clientTime; // the ping's payload
+  uint64_t received;   // when the ping was read
+  int64_t epochOffset; // device time to microseconds since 1970, 0 without SNTP
+};
+
+// Payload of MESSAGE_FRAME_SENT, sent right after a frame with the device
+// time its last byte was accepted by the socket.
+struct __attribute__((packed)) FrameSentRecord {
+  uint32_t sequence;
+  uint64_t timestamp; // capture time of the frame
+  uint64_t written;
+};
+
+// Pipeline stages timed for every frame.
+enum StatsStage : uint8_t {
+  STAGE_GRAB = 0,   // time spent in esp_camera_fb_get()
+  STAGE_BUFFER = 1, // frame completed by the driver until handed to us
+  STAGE_QUEUE = 2,  // grabbed until handed to the clients
+  STAGE_SEND = 3,   // handed to a client until its last byte was written
+  STAGE_TOTAL = 4,  // frame completed by the driver until written
+  STAGE_COUNT
+};
+
+// Event counters, new ones are only ever appended.
+enum StatsCounter : uint8_t {
+  COUNTER_FRAMES_CAPTURED = 0,
+  COUNTER_FRAMES_SENT = 1,     // frames written completely, per client
+  COUNTER_FRAMES_DROPPED = 2,  // frames a client skipped while busy
+  COUNTER_QUEUE_DROPS = 3,     // frames dropped from the full frame queue
+  COUNTER_SKIPPED_SLOTS = 4,   // frame deadlines missed by the pacer
+  COUNTER_SHORT_WRITES = 5,    // sends the socket only partly accepted
+  COUNTER_CONNECTS = 6,        // clients accepted
+  COUNTER_CAPTURE_ERRORS = 7,
+  COUNTER_FRAMES_GATED = 8,    // frames held back by the motion detector
+  COUNTER_STALE_FRAMES = 9,    // frames of the previous size after a stream switch
+  COUNTER_WIFI_RECONNECTS = 10,
+  COUNTER_FRAMES_SPOOLED = 11,  // frames stored on the SD card during an outage
+  COUNTER_SPOOL_DROPS = 12,     // frames the SD card spool had no room for
+  COUNTER_BACKLOG_SENT = 13,    // spooled frames written to a client
+  COUNTER_COUNT
+};
+
+// Latency distribution of one stage in microseconds.
+struct __attribute__((packed)) StageSummary {
+  uint32_t count;
+  uint32_t p50;
+  uint32_t p95;
+  uint32_t p99;
+  uint32_t max;
+};
+
+// Payload of MESSAGE_STATS. Percentiles cover the last one to two
+// statistics windows, counters are totals since boot.
+struct __attribute__((packed)) StatsRecord {
+  uint32_t uptime; // milliseconds
+  uint8_t stageCount;
+  uint8_t counterCount;
+  StageSummary stages[STAGE_COUNT];
+  uint32_t counters[COUNTER_COUNT];
+  char variant[16]; // FIRMWARE_VARIANT, NUL padded
+};
+
+// "ECAU", starts every datagram of the UDP stream.
+#define FRAGMENT_MAGIC 0x55414345
+
+// A frame sent over UDP is split into datagrams of this header followed by
+// up to UDP_PAYLOAD_SIZE bytes of the frame starting at `offset`. A frame
+// with any fragment missing is discarded by the receiver, later frames are
+// not affected.
+struct __attribute__((packed)) FragmentHeader {
+  uint32_t magic;     // FRAGMENT_MAGIC
+  uint32_t sequence;  // frame counter
+  uint32_t length;    // length of the whole frame
+  uint32_t offset;    // position of this fragment within the frame
+  uint16_t fragment;  // index of this fragment
+  uint16_t fragments; // number of fragments of the frame
+  uint16_t width;
+  uint16_t height;
+  uint64_t timestamp; // capture time in microseconds
+};
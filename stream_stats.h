@@ -0,0 +1,114 @@
+#pragma once
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "stream_protocol.h"
+
+// Length of one statistics window (microseconds). Percentiles are computed
+// over the current and the previous window.
+#define STATS_WINDOW 10000000LL
+// Four buckets per power of two from 1 us up to about 67 s
+#define HISTOGRAM_BUCKETS 108
+
+struct Histogram {
+  uint32_t buckets[HISTOGRAM_BUCKETS];
+  uint32_t count;
+  uint32_t max;
+};
+
+struct StreamStats {
+  Histogram windows[2][STAGE_COUNT];
+  uint8_t current;
+  int64_t windowStart;
+  uint32_t counters[COUNTER_COUNT];
+};
+
+static StreamStats streamStats;
+static portMUX_TYPE statsLock = portMUX_INITIALIZER_UNLOCKED;
+
+static int histogramBucket(uint32_t value) {
+  if (value < 4) {
+    return value;
+  }
+  int log = 31 - __builtin_clz(value);
+  int index = log * 4 + ((value >> (log - 2)) & 3);
+  return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+// Smallest value that falls into `index`.
+static uint32_t histogramBucketValue(int index) {
+  if (index < 4) {
+    return index;
+  }
+  int log = index / 4;
+  return (uint32_t)(4 + index % 4) << (log - 2);
+}
+
+static void statsRollWindow(int64_t now) {
+  if (now - streamStats.windowStart < STATS_WINDOW) {
+    return;
+  }
+  streamStats.current ^= 1;
+  memset(streamStats.windows[streamStats.current], 0, sizeof(streamStats.windows[0]));
+  streamStats.windowStart = now;
+}
+
+// Records that `stage` took `duration` microseconds.
+void statsTime(StatsStage stage, int64_t duration) {
+  uint32_t value = duration < 0 ? 0 : duration > UINT32_MAX ? UINT32_MAX : duration;
+  portENTER_CRITICAL(&statsLock);
+  statsRollWindow(esp_timer_get_time());
+  Histogram &histogram = streamStats.windows[streamStats.current][stage];
+  histogram.buckets[histogramBucket(value)]++;
+  histogram.count++;
+  if (value > histogram.max) {
+    histogram.max = value;
+  }
+  portEXIT_CRITICAL(&statsLock);
+}
+
+void statsCount(StatsCounter counter, uint32_t increment = 1) {
+  __atomic_fetch_add(&streamStats.counters[counter], increment, __ATOMIC_RELAXED);
+}
+
+static void summarize(const Histogram &a, const Histogram &b, StageSummary &summary) {
+  summary.count = a.count + b.count;
+  summary.max = a.max > b.max ? a.max : b.max;
+  uint32_t ranks[3] = {
+    (uint32_t)(summary.count * 0.50), (uint32_t)(summary.count * 0.95), (uint32_t)(summary.count * 0.99)
+  };
+  uint32_t values[3];
+  uint32_t seen = 0;
+  int next = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS && next < 3; i++) {
+    seen += a.buckets[i] + b.buckets[i];
+    while (next < 3 && seen > ranks[next]) {
+      values[next++] = histogramBucketValue(i);
+    }
+  }
+  while (next < 3) {
+    values[next++] = summary.max;
+  }
+  summary.p50 = values[0];
+  summary.p95 = values[1];
+  summary.p99 = values[2];
+}
+
+void statsFillRecord(StatsRecord &record) {
+  record.uptime = esp_timer_get_time() / 1000;
+  record.stageCount = STAGE_COUNT;
+  record.counterCount = COUNTER_COUNT;
+
+  portENTER_CRITICAL(&statsLock);
+  statsRollWindow(esp_timer_get_time());
+  for (int stage = 0; stage < STAGE_COUNT; stage++) {
+    summarize(streamStats.windows[0][stage], streamStats.windows[1][stage], record.stages[stage]);
+  }
+  portEXIT_CRITICAL(&statsLock);
+
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    record.counters[i] = __atomic_load_n(&streamStats.counters[i], __ATOMIC_RELAXED);
+  }
+  memset(record.variant, 0, sizeof(record.variant));
+  strncpy(record.variant, FIRMWARE_VARIANT, sizeof(record.variant) - 1);
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include "esp_timer.h"
+
+// Time the capture and network tasks spend waiting, for the power governor
+// (see power_governor.h). Without PIPELINE_TASKS both run in loop() and
+// share one entry.
+#define LOAD_TASKS (PIPELINE_TASKS ? 2 : 1)
+enum LoadTask : uint8_t {
+  LOAD_CAPTURE = 0,
+  LOAD_NETWORK = LOAD_TASKS - 1,
+};
+
+// Microseconds each task waited, wrapping. Every entry is only written by
+// its own task, and 32 bits are read in one piece by the others.
+static volatile uint32_t loadIdle[LOAD_TASKS];
+
+static inline void loadWaited(LoadTask task, int64_t duration) {
+  loadIdle[task] += (uint32_t)duration;
+}
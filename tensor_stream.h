@@ -0,0 +1,69 @@
+#pragma once
+#include "esp_camera.h"
+#include "frame_stream.h"
+
+#if TENSOR_STREAM && (MOTION_GATING || ADAPTIVE_BITRATE || MULTI_STREAM || COMPACT_JPEG)
+#error "TENSOR_STREAM sends uncompressed frames, which the JPEG features can't handle"
+#endif
+
+// Format the camera is initialized with
+#if TENSOR_STREAM
+#define CAMERA_PIXFORMAT TENSOR_PIXFORMAT
+#else
+#define CAMERA_PIXFORMAT PIXFORMAT_JPEG
+#endif
+
+// Box filter from a luma plane of `width` x `height` pixels, `stride`
+// bytes apart (1 for grayscale, 2 for the Y of YUV422), down to a
+// TENSOR_WIDTH x TENSOR_HEIGHT grayscale image. Every output pixel is the
+// average of the source pixels it covers. Output pixels never lie behind
+// the source pixels still to be read, so `out` may be `in`.
+//
+// At 240x240 this is about 60k additions per frame, well below a
+// millisecond, so it is plain C on every chip rather than S3 vector code.
+static void downscaleLuma(const uint8_t *in, int width, int height, int stride, uint8_t *out) {
+  int left[TENSOR_WIDTH + 1];
+  for (int x = 0; x <= TENSOR_WIDTH; x++) {
+    left[x] = x * width / TENSOR_WIDTH;
+  }
+  for (int y = 0; y < TENSOR_HEIGHT; y++) {
+    int top = y * height / TENSOR_HEIGHT;
+    int bottom = (y + 1) * height / TENSOR_HEIGHT;
+    for (int x = 0; x < TENSOR_WIDTH; x++) {
+      uint32_t sum = 0;
+      for (int row = top; row < bottom; row++) {
+        const uint8_t *pixel = in + (row * width + left[x]) * stride;
+        for (int column = left[x]; column < left[x + 1]; column++) {
+          sum += *pixel;
+          pixel += stride;
+        }
+      }
+      uint32_t count = (bottom - top) * (left[x + 1] - left[x]);
+      out[y * TENSOR_WIDTH + x] = (sum + count / 2) / count;
+    }
+  }
+}
+
+// Turns the captured frame into a TENSOR_WIDTH x TENSOR_HEIGHT grayscale
+// image in place in its frame buffer and updates the header to match.
+// Returns false for frames that are smaller than that or not uncompressed.
+bool tensorFrame(CapturedFrame &frame) {
+  const camera_fb_t *fb = frame.fb;
+  int stride;
+  if (fb->format == PIXFORMAT_GRAYSCALE) {
+    stride = 1;
+  } else if (fb->format == PIXFORMAT_YUV422) {
+    stride = 2;
+  } else {
+    return false;
+  }
+  if (fb->width < TENSOR_WIDTH || fb->height < TENSOR_HEIGHT) {
+    return false;
+  }
+  downscaleLuma(fb->buf, fb->width, fb->height, stride, fb->buf);
+  frame.header.format = PIXFORMAT_GRAYSCALE;
+  frame.header.length = TENSOR_WIDTH * TENSOR_HEIGHT;
+  frame.header.width = TENSOR_WIDTH;
+  frame.header.height = TENSOR_HEIGHT;
+  return true;
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Builds every firmware variant of tools/variants.txt (or the file given)
+# with arduino-cli, into build/variants/<name>/. Each variant is a copy of
+# the sketch with its defines replaced, so a define that doesn't exist is
+# an error rather than silently ignored.
+#
+#   FQBN=esp32:esp32:esp32cam:PartitionScheme=min_spiffs tools/build_variants.sh
+#
+# The partition scheme needs two app partitions for OTA_UPDATES.
+set -eu
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+variants=${1:-$root/tools/variants.txt}
+fqbn=${FQBN:-esp32:esp32:esp32cam:PartitionScheme=min_spiffs}
+out=$root/build/variants
+
+# Sets `#define name value` in whichever file of the sketch copy defines it
+# (plain sh has no locals, hence the prefixed names)
+set_define() {
+  sd_dir=$1 sd_name=$2 sd_value=$3
+  sd_file=$(grep -l "^#define $sd_name\( \|$\)" "$sd_dir"/*.ino "$sd_dir"/*.h | head -n 1) || true
+  if [ -z "$sd_file" ]; then
+    echo "$sd_name isn't defined in the sketch" >&2
+    exit 1
+  fi
+  sd_value=$(printf '%s' "$sd_value" | sed 's/[\\&|]/\\&/g')
+  sed -i.orig "s|^#define $sd_name\( .*\)\{0,1\}$|#define $sd_name $sd_value|" "$sd_file"
+  rm -f "$sd_file.orig"
+}
+
+grep -v '^[[:space:]]*\(#\|$\)' "$variants" | while read -r name defines; do
+  echo "== $name: $defines"
+  # arduino-cli wants the sketch in a directory of the same name
+  sketch=$out/$name/camera.tcp
+  rm -rf "$out/$name"
+  mkdir -p "$sketch"
+  cp "$root"/*.ino "$root"/*.h "$sketch"/
+  set_define "$sketch" FIRMWARE_VARIANT "\"$name\""
+  for define in $defines; do
+    set_define "$sketch" "${define%%=*}" "${define#*=}"
+  done
+  arduino-cli compile --fqbn "$fqbn" --output-dir "$out/$name" "$sketch"
+done
@@ -0,0 +1,140 @@
+#pragma once
+#include <errno.h>
+#include "lwip/sockets.h"
+#include "esp_timer.h"
+#include "frame_stream.h"
+#include "event_loop.h"
+
+// Frame bytes per datagram, keeps datagrams within a 1500 byte MTU
+#define UDP_PAYLOAD_SIZE 1400
+#define UDP_MAX_SUBSCRIBERS 2
+// Subscribers have to send a datagram at least this often (ms)
+#define UDP_SUBSCRIPTION_TIMEOUT_MS 10000
+
+// Any datagram received on UDP_PORT subscribes its sender to the stream.
+// Frames are sent as FragmentHeader prefixed datagrams, so a lost datagram
+// costs a single frame instead of stalling the stream like TCP does.
+struct UdpSubscriber {
+  struct sockaddr_in address;
+  int64_t lastSeen; // 0 if the slot is free
+};
+
+struct UdpStream {
+  int socket;
+  UdpSubscriber subscribers[UDP_MAX_SUBSCRIBERS];
+};
+
+bool udpBegin(UdpStream &udp, uint16_t port) {
+  udp.socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (udp.socket < 0) {
+    Serial.println("Failed to create UDP socket");
+    return false;
+  }
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(udp.socket, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    Serial.printf("Failed to bind UDP port %d\n", port);
+    close(udp.socket);
+    udp.socket = -1;
+    return false;
+  }
+  fcntl(udp.socket, F_SETFL, fcntl(udp.socket, F_GETFL, 0) | O_NONBLOCK);
+  Serial.printf("UDP stream on port %d\n", port);
+  return true;
+}
+
+// Adds the socket subscription requests arrive on.
+void udpWatch(UdpStream &udp, EventSet &events) {
+  eventsRead(events, udp.socket);
+}
+
+// Registers new subscribers and expires silent ones.
+void udpPoll(UdpStream &udp) {
+  if (udp.socket < 0) {
+    return;
+  }
+  int64_t now = esp_timer_get_time();
+  uint8_t datagram[32];
+  struct sockaddr_in from;
+  socklen_t fromLength = sizeof(from);
+  while (recvfrom(udp.socket, datagram, sizeof(datagram), 0, (struct sockaddr *)&from, &fromLength) >= 0) {
+    UdpSubscriber *subscriber = NULL;
+    for (int i = 0; i < UDP_MAX_SUBSCRIBERS && !subscriber; i++) {
+      UdpSubscriber &candidate = udp.subscribers[i];
+      if (candidate.lastSeen && candidate.address.sin_addr.s_addr == from.sin_addr.s_addr &&
+          candidate.address.sin_port == from.sin_port) {
+        subscriber = &candidate;
+      }
+    }
+    for (int i = 0; i < UDP_MAX_SUBSCRIBERS && !subscriber; i++) {
+      if (!udp.subscribers[i].lastSeen) {
+        subscriber = &udp.subscribers[i];
+        subscriber->address = from;
+        Serial.printf("UDP subscriber %d: %s:%d\n", i, inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+      }
+    }
+    if (subscriber) {
+      subscriber->lastSeen = now;
+    }
+    fromLength = sizeof(from);
+  }
+
+  for (int i = 0; i < UDP_MAX_SUBSCRIBERS; i++) {
+    UdpSubscriber &subscriber = udp.subscribers[i];
+    if (subscriber.lastSeen && now - subscriber.lastSeen > UDP_SUBSCRIPTION_TIMEOUT_MS * 1000LL) {
+      subscriber.lastSeen = 0;
+      Serial.printf("UDP subscriber %d timed out\n", i);
+    }
+  }
+}
+
+bool udpSubscribed(UdpStream &udp) {
+  for (int i = 0; i < UDP_MAX_SUBSCRIBERS; i++) {
+    if (udp.subscribers[i].lastSeen) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Sends the frame to every subscriber. A fragment that can't be sent ends the
+// frame for that subscriber; the remaining fragments would be useless.
+void udpPublish(UdpStream &udp, const CapturedFrame &frame) {
+  const camera_fb_t *fb = frame.fb;
+  FragmentHeader header;
+  header.magic = FRAGMENT_MAGIC;
+  header.sequence = frame.header.sequence;
+  header.length = frame.header.length;
+  header.fragments = (header.length + UDP_PAYLOAD_SIZE - 1) / UDP_PAYLOAD_SIZE;
+  header.width = frame.header.width;
+  header.height = frame.header.height;
+  header.timestamp = frame.header.timestamp;
+
+  for (int i = 0; i < UDP_MAX_SUBSCRIBERS; i++) {
+    UdpSubscriber &subscriber = udp.subscribers[i];
+    if (!subscriber.lastSeen) {
+      continue;
+    }
+    for (uint16_t fragment = 0; fragment < header.fragments; fragment++) {
+      header.fragment = fragment;
+      header.offset = fragment * UDP_PAYLOAD_SIZE;
+      size_t length = min((size_t)UDP_PAYLOAD_SIZE, (size_t)(header.length - header.offset));
+
+      struct iovec parts[2] = {
+        { &header, sizeof(header) },
+        { fb->buf + header.offset, length },
+      };
+      struct msghdr message = {};
+      message.msg_name = &subscriber.address;
+      message.msg_namelen = sizeof(subscriber.address);
+      message.msg_iov = parts;
+      message.msg_iovlen = 2;
+      if (sendmsg(udp.socket, &message, 0) < 0) {
+        statsCount(COUNTER_FRAMES_DROPPED);
+        break;
+      }
+    }
+  }
+}
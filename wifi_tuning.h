@@ -0,0 +1,147 @@
+#pragma once
+#include <string.h>
+#include <WiFi.h>
+#include <Preferences.h>
+#include "esp_wifi.h"
+#include "esp_timer.h"
+#include "stream_stats.h"
+
+// How often the connection status is checked while connecting
+#define WIFI_POLL_MS 50
+// Time allowed to join the cached access point before scanning for it
+#define WIFI_CACHED_CONNECT_MS 3000
+// Time allowed for a connection with a full scan
+#define WIFI_SCAN_CONNECT_MS 15000
+// Namespace in NVS the access point is cached in
+#define WIFI_CACHE_NAMESPACE "wifi"
+
+// Access point joined last time. Connecting to a known BSSID on a known
+// channel skips the scan, which takes most of the time of a connect.
+struct WifiCache {
+  char ssid[33];
+  uint8_t bssid[6];
+  uint8_t channel; // 0 if nothing is cached
+};
+
+struct WifiLink {
+  const char *ssid;
+  const char *password;
+  WifiCache cache;
+  bool connected;
+  bool usingCache;  // the current attempt uses the cached access point
+  int64_t attempt;  // start of the current connection attempt
+  int64_t lost;     // when the connection dropped
+};
+
+static void wifiLoadCache(WifiLink &link) {
+  Preferences prefs;
+  link.cache.channel = 0;
+  if (!prefs.begin(WIFI_CACHE_NAMESPACE, true)) {
+    return;
+  }
+  bool valid = prefs.getBytes("ap", &link.cache, sizeof(link.cache)) == sizeof(link.cache);
+  prefs.end();
+  if (!valid || strncmp(link.cache.ssid, link.ssid, sizeof(link.cache.ssid)) != 0) {
+    link.cache.channel = 0;
+  }
+}
+
+// Writes the access point we are connected to, unless it is cached already.
+static void wifiStoreCache(WifiLink &link) {
+  WifiCache current = {};
+  strncpy(current.ssid, link.ssid, sizeof(current.ssid) - 1);
+  memcpy(current.bssid, WiFi.BSSID(), sizeof(current.bssid));
+  current.channel = WiFi.channel();
+  if (memcmp(&current, &link.cache, sizeof(current)) == 0) {
+    return;
+  }
+  link.cache = current;
+  Preferences prefs;
+  if (prefs.begin(WIFI_CACHE_NAMESPACE, false)) {
+    prefs.putBytes("ap", &current, sizeof(current));
+    prefs.end();
+  }
+}
+
+static void wifiStartAttempt(WifiLink &link) {
+  link.usingCache = link.cache.channel != 0;
+  if (link.usingCache) {
+    WiFi.begin(link.ssid, link.password, link.cache.channel, link.cache.bssid);
+  } else {
+    WiFi.begin(link.ssid, link.password);
+  }
+  link.attempt = esp_timer_get_time();
+}
+
+// Checks on the current connection attempt. Returns true once connected;
+// a cached access point that doesn't answer is forgotten and scanned for.
+static bool wifiAttemptDone(WifiLink &link) {
+  if (WiFi.status() == WL_CONNECTED) {
+    wifiStoreCache(link);
+    return true;
+  }
+  int64_t elapsed = (esp_timer_get_time() - link.attempt) / 1000;
+  if (elapsed >= (link.usingCache ? WIFI_CACHED_CONNECT_MS : WIFI_SCAN_CONNECT_MS)) {
+    if (link.usingCache) {
+      Serial.println("Cached access point not found, scanning");
+      link.cache.channel = 0;
+    }
+    wifiStartAttempt(link);
+  }
+  return false;
+}
+
+// Sets the radio up for streaming and blocks until the first connection.
+// `started` is called once the driver has allocated its buffers, before
+// associating.
+void wifiConnect(WifiLink &link, const char *ssid, const char *password, void (*started)() = nullptr) {
+  link.ssid = ssid;
+  link.password = password;
+
+  // The cache in NVS replaces the driver's own, which rewrites flash on
+  // every connect
+  WiFi.persistent(false);
+  WiFi.mode(WIFI_STA);
+  // Modem sleep delays every packet by up to a beacon interval
+  WiFi.setSleep(false);
+  WiFi.setTxPower(WIFI_TX_POWER);
+  esp_wifi_set_protocol(WIFI_IF_STA, WIFI_PROTOCOLS);
+#if STATIC_IP
+  // Saves the DHCP exchange on every connect
+  WiFi.config(IPAddress(STATIC_IP_ADDRESS), IPAddress(STATIC_IP_GATEWAY),
+              IPAddress(STATIC_IP_SUBNET), IPAddress(STATIC_IP_GATEWAY));
+#endif
+  if (started) {
+    started();
+  }
+
+  wifiLoadCache(link);
+  int64_t start = esp_timer_get_time();
+  wifiStartAttempt(link);
+  while (!wifiAttemptDone(link)) {
+    delay(WIFI_POLL_MS);
+  }
+  link.connected = true;
+  Serial.printf("Connected to WiFi in %d ms (channel %d, RSSI %d)\n",
+                (int)((esp_timer_get_time() - start) / 1000), WiFi.channel(), WiFi.RSSI());
+}
+
+// Called regularly after wifiConnect(). Reconnects without blocking when
+// the connection drops; the servers keep listening in the meantime.
+void wifiMaintain(WifiLink &link) {
+  if (link.connected) {
+    if (WiFi.status() == WL_CONNECTED) {
+      return;
+    }
+    Serial.println("WiFi connection lost, reconnecting");
+    link.connected = false;
+    link.lost = esp_timer_get_time();
+    wifiStartAttempt(link);
+    return;
+  }
+  if (wifiAttemptDone(link)) {
+    link.connected = true;
+    statsCount(COUNTER_WIFI_RECONNECTS);
+    Serial.printf("Reconnected to WiFi after %d ms\n", (int)((esp_timer_get_time() - link.lost) / 1000));
+  }
+}